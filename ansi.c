@@ -0,0 +1,343 @@
+#include "ansi.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SGR_MAX 12
+#define ERASE_MIN 11 /* blank runs erased instead of printed */
+
+/* select graphic rendition for a foreground, a background or both, built
+ * once so a flush only copies them */
+static char sgr_fg[FRAME_NCOLORS][SGR_MAX];
+static char sgr_bg[FRAME_NCOLORS][SGR_MAX];
+static char sgr_both[FRAME_NCOLORS][FRAME_NCOLORS][SGR_MAX];
+
+/* parameter of a colour, base is 30 for the foreground and 40 otherwise */
+static int
+sgr_color(int color, int base)
+{
+	if (color == FRAME_DEFAULT)
+		return base + 9;
+	if (color <= 8)
+		return base + color - 1;
+	return base + 60 + color - 9; /* bright */
+}
+
+static void
+sgr_cache(void)
+{
+	if (sgr_fg[0][0])
+		return;
+
+	for (int f = 0; f < FRAME_NCOLORS; ++f) {
+		snprintf(sgr_fg[f], SGR_MAX, "\x1b[%dm", sgr_color(f, 30));
+		snprintf(sgr_bg[f], SGR_MAX, "\x1b[%dm", sgr_color(f, 40));
+		for (int b = 0; b < FRAME_NCOLORS; ++b)
+			snprintf(sgr_both[f][b], SGR_MAX, "\x1b[%d;%dm",
+				 sgr_color(f, 30), sgr_color(b, 40));
+	}
+}
+
+static int
+utf8_encode(char *out, uint32_t glyph)
+{
+	if (glyph < 0x80) {
+		out[0] = glyph;
+		return 1;
+	}
+	if (glyph < 0x800) {
+		out[0] = 0xc0 | (glyph >> 6);
+		out[1] = 0x80 | (glyph & 0x3f);
+		return 2;
+	}
+	out[0] = 0xe0 | (glyph >> 12);
+	out[1] = 0x80 | ((glyph >> 6) & 0x3f);
+	out[2] = 0x80 | (glyph & 0x3f);
+	return 3;
+}
+
+static int
+utf8_length(uint32_t glyph)
+{
+	return glyph < 0x80 ? 1 : glyph < 0x800 ? 2 : 3;
+}
+
+static void
+out_append(struct frame *frame, const char *bytes, size_t len)
+{
+	if (frame->out_len + len > frame->out_cap) {
+		size_t cap = frame->out_cap * 2 + len;
+		char *out = realloc(frame->out, cap);
+		if (!out)
+			return;
+		frame->out = out;
+		frame->out_cap = cap;
+	}
+	memcpy(frame->out + frame->out_len, bytes, len);
+	frame->out_len += len;
+}
+
+static void
+out_printf(struct frame *frame, const char *format, int a, int b)
+{
+	char buffer[32];
+	int len = snprintf(buffer, sizeof(buffer), format, a, b);
+	out_append(frame, buffer, len);
+}
+
+static inline bool
+cell_equal(const struct cell *a, const struct cell *b)
+{
+	return a->glyph == b->glyph && a->fg == b->fg && a->bg == b->bg;
+}
+
+/* The terminal is expected to be blank when the frame is created */
+int
+frame_init(struct frame *frame, int rows, int cols)
+{
+	sgr_cache();
+	*frame = (struct frame) {0};
+	frame->rows = rows;
+	frame->cols = cols;
+	frame->cells = malloc(sizeof(struct cell) * rows * cols);
+	frame->shown = malloc(sizeof(struct cell) * rows * cols);
+	frame->out_cap = (size_t) rows * cols * 4;
+	frame->out = malloc(frame->out_cap);
+	if (!frame->cells || !frame->shown || !frame->out) {
+		frame_free(frame);
+		return -1;
+	}
+
+	for (int n = 0; n < rows * cols; ++n)
+		frame->cells[n] = frame->shown[n] = (struct cell) { ' ', FRAME_DEFAULT, FRAME_DEFAULT };
+	frame->cursor_y = frame->cursor_x = -1;
+	frame->fg = frame->bg = -1;
+	return 0;
+}
+
+void
+frame_free(struct frame *frame)
+{
+	free(frame->cells);
+	free(frame->shown);
+	free(frame->out);
+	*frame = (struct frame) {0};
+}
+
+/*** Drawing ***/
+
+/* Cells outside of the frame are clipped */
+void
+frame_put(struct frame *frame, int y, int x, uint32_t glyph, int fg, int bg)
+{
+	if (y < 0 || y >= frame->rows || x < 0 || x >= frame->cols)
+		return;
+	frame->cells[y * frame->cols + x] = (struct cell) { glyph, fg, bg };
+}
+
+/* Colour the upper or lower half of a cell, y counts half cells. Cells are
+ * kept in a canonical form so equal colours always diff as equal. */
+void
+frame_put_half(struct frame *frame, int y, int x, int color)
+{
+	if (y < 0 || y >= frame->rows * 2 || x < 0 || x >= frame->cols)
+		return;
+
+	struct cell *cell = &frame->cells[(y / 2) * frame->cols + x];
+	int top, bottom;
+	switch (cell->glyph) {
+	case HALF_UPPER: top = cell->fg; bottom = cell->bg; break;
+	case HALF_LOWER: top = cell->bg; bottom = cell->fg; break;
+	case ' ':        top = bottom = cell->bg;           break;
+	default:         top = bottom = FRAME_DEFAULT;      break;
+	}
+	if (y & 1)
+		bottom = color;
+	else
+		top = color;
+
+	if (top == bottom)
+		*cell = (struct cell) { ' ', FRAME_DEFAULT, top };
+	else if (top == FRAME_DEFAULT)
+		*cell = (struct cell) { HALF_LOWER, bottom, FRAME_DEFAULT };
+	else
+		*cell = (struct cell) { HALF_UPPER, top, bottom };
+}
+
+/* ascii text in default colours */
+void
+frame_text(struct frame *frame, int y, int x, const char *text)
+{
+	for (; *text; ++text, ++x)
+		frame_put(frame, y, x, (unsigned char) *text, FRAME_DEFAULT, FRAME_DEFAULT);
+}
+
+void
+frame_fill(struct frame *frame, int y, int x, int h, int w)
+{
+	for (int r = y; r < y + h; ++r)
+		for (int c = x; c < x + w; ++c)
+			frame_put(frame, r, c, ' ', FRAME_DEFAULT, FRAME_DEFAULT);
+}
+
+void
+frame_box(struct frame *frame, int y, int x, int h, int w)
+{
+	int bottom = y + h - 1;
+	int right  = x + w - 1;
+	for (int c = x + 1; c < right; ++c) {
+		frame_put(frame, y, c, 0x2500, FRAME_DEFAULT, FRAME_DEFAULT);
+		frame_put(frame, bottom, c, 0x2500, FRAME_DEFAULT, FRAME_DEFAULT);
+	}
+	for (int r = y + 1; r < bottom; ++r) {
+		frame_put(frame, r, x, 0x2502, FRAME_DEFAULT, FRAME_DEFAULT);
+		frame_put(frame, r, right, 0x2502, FRAME_DEFAULT, FRAME_DEFAULT);
+	}
+	frame_put(frame, y, x, 0x250c, FRAME_DEFAULT, FRAME_DEFAULT);
+	frame_put(frame, y, right, 0x2510, FRAME_DEFAULT, FRAME_DEFAULT);
+	frame_put(frame, bottom, x, 0x2514, FRAME_DEFAULT, FRAME_DEFAULT);
+	frame_put(frame, bottom, right, 0x2518, FRAME_DEFAULT, FRAME_DEFAULT);
+}
+
+/*** Output ***/
+
+/* Bytes to step over the unchanged cells before x by printing them again,
+ * or -1 when they need other colours */
+static int
+reprint_length(const struct frame *frame, const struct cell *row, int x)
+{
+	int len = 0;
+	for (int c = frame->cursor_x; c < x; ++c) {
+		if (row[c].fg != frame->fg || row[c].bg != frame->bg)
+			return -1;
+		len += utf8_length(row[c].glyph);
+	}
+	return len;
+}
+
+/* cheapest of a reprint, a relative or an absolute cursor move */
+static void
+move_cursor(struct frame *frame, const struct cell *row, int y, int x)
+{
+	if (frame->cursor_y == y && frame->cursor_x == x)
+		return;
+
+	if (frame->cursor_y == y && frame->cursor_x >= 0 && frame->cursor_x < x) {
+		int gap = x - frame->cursor_x;
+		int forward = gap < 10 ? 4 : gap < 100 ? 5 : 6;
+		int reprint = reprint_length(frame, row, x);
+		if (reprint >= 0 && reprint <= forward) {
+			char glyph[4];
+			for (int c = frame->cursor_x; c < x; ++c)
+				out_append(frame, glyph, utf8_encode(glyph, row[c].glyph));
+		} else {
+			out_printf(frame, "\x1b[%dC", gap, 0);
+		}
+	} else if (frame->cursor_y == y - 1 && frame->cursor_x >= 0 && x == 0) {
+		out_append(frame, "\r\n", 2);
+	} else if (x == 0) {
+		out_printf(frame, "\x1b[%dH", y + 1, 0);
+	} else {
+		out_printf(frame, "\x1b[%d;%dH", y + 1, x + 1);
+	}
+	frame->cursor_y = y;
+	frame->cursor_x = x;
+}
+
+static void
+set_colors(struct frame *frame, int fg, int bg)
+{
+	if (fg == frame->fg && bg == frame->bg)
+		return;
+
+	const char *sgr;
+	if (bg == frame->bg)
+		sgr = sgr_fg[fg];
+	else if (fg == frame->fg)
+		sgr = sgr_bg[bg];
+	else
+		sgr = sgr_both[fg][bg];
+	out_append(frame, sgr, strlen(sgr));
+	frame->fg = fg;
+	frame->bg = bg;
+}
+
+/* blank cells in default colours starting at x */
+static int
+blank_run(const struct frame *frame, const struct cell *row, int x)
+{
+	int run = 0;
+	while (x + run < frame->cols && row[x + run].glyph == ' '
+	       && row[x + run].fg == FRAME_DEFAULT && row[x + run].bg == FRAME_DEFAULT)
+		++run;
+	return run;
+}
+
+/* Write what the terminal has not taken of the last flush. Returns false
+ * while a non-blocking fd still has some left, errors drop the rest. */
+bool
+frame_drain(struct frame *frame, int fd)
+{
+	while (frame->out_sent < frame->out_len) {
+		ssize_t n = write(fd, frame->out + frame->out_sent,
+				  frame->out_len - frame->out_sent);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return false;
+		if (n <= 0)
+			break;
+		frame->out_sent += n;
+	}
+	frame->out_sent = frame->out_len;
+	return true;
+}
+
+/* Write the cells which changed since the last flush with a single write,
+ * returns the number of bytes. The output of the last flush has to be
+ * drained first, the cells already count as shown. */
+size_t
+frame_flush(struct frame *frame, int fd)
+{
+	frame->out_len = 0;
+	frame->out_sent = 0;
+	for (int y = 0; y < frame->rows; ++y) {
+		struct cell *row   = &frame->cells[y * frame->cols];
+		struct cell *shown = &frame->shown[y * frame->cols];
+		for (int x = 0; x < frame->cols; ++x) {
+			if (cell_equal(&row[x], &shown[x]))
+				continue;
+
+			move_cursor(frame, shown, y, x);
+			set_colors(frame, row[x].fg, row[x].bg);
+
+			/* long blank runs are erased without moving the cursor */
+			int run = blank_run(frame, row, x);
+			if (run >= ERASE_MIN) {
+				out_printf(frame, "\x1b[%dX", run, 0);
+				memcpy(&shown[x], &row[x], sizeof(struct cell) * run);
+				x += run - 1;
+				continue;
+			}
+
+			char glyph[4];
+			out_append(frame, glyph, utf8_encode(glyph, row[x].glyph));
+			shown[x] = row[x];
+
+			/* the cursor waits to wrap after the last column */
+			if (++frame->cursor_x >= frame->cols)
+				frame->cursor_y = frame->cursor_x = -1;
+		}
+	}
+
+	frame->bytes = frame->out_len;
+	if (frame->out_len) {
+		frame_drain(frame, fd);
+		frame->frames += 1;
+		frame->bytes_total += frame->out_len;
+	}
+	return frame->bytes;
+}
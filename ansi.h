@@ -0,0 +1,54 @@
+#ifndef ANSI_H
+#define ANSI_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* colours of a cell, the terminal default or one of the 16 ansi colours,
+ * 8 and above are the bright ones */
+#define FRAME_DEFAULT   0
+#define FRAME_COLOR(n)  ((n) + 1)
+#define FRAME_NCOLORS   17
+
+/* half blocks, a cell holds two pixels of colour */
+#define HALF_UPPER      0x2580
+#define HALF_LOWER      0x2584
+
+struct cell {
+	uint32_t glyph; /* unicode code point */
+	uint8_t fg, bg;
+};
+
+/* A screen worth of cells drawn in memory. Flushing compares the cells with
+ * those already on the terminal and writes only the differences. */
+struct frame {
+	int rows, cols;
+	struct cell *cells; /* being drawn */
+	struct cell *shown; /* on the terminal */
+
+	char *out;
+	size_t out_len, out_cap;
+	size_t out_sent; /* written so far, the rest waits for the terminal */
+
+	/* terminal cursor and colours, -1 when unknown */
+	int cursor_y, cursor_x;
+	int fg, bg;
+
+	size_t bytes;        /* written by the last flush */
+	uint64_t frames;     /* flushes which wrote something */
+	uint64_t bytes_total;
+};
+
+int frame_init(struct frame *frame, int rows, int cols);
+void frame_free(struct frame *frame);
+
+void frame_put(struct frame *frame, int y, int x, uint32_t glyph, int fg, int bg);
+void frame_put_half(struct frame *frame, int y, int x, int color);
+void frame_text(struct frame *frame, int y, int x, const char *text);
+void frame_fill(struct frame *frame, int y, int x, int h, int w);
+void frame_box(struct frame *frame, int y, int x, int h, int w);
+
+size_t frame_flush(struct frame *frame, int fd);
+bool frame_drain(struct frame *frame, int fd);
+#endif
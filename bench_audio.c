@@ -0,0 +1,108 @@
+/* Latency of sound effects from sound_play until the mixer picks them up,
+ * on the null backend so it runs without sound hardware.
+ *
+ * bench_audio [frames[:count] ...]  period sizes to measure, 64 to 1024 by
+ *                                   default, without a count the backend's
+ *
+ * Effects are triggered at an interval which shares no factor with the
+ * period, so they land all over it as keys would. The null backend polls
+ * its clock every 10 ms, periods shorter than that measure the poll. */
+#include "sound.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define TRIGGERS 500
+#define INTERVAL 3100000 /* nanoseconds between triggers */
+
+static int
+usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [frames[:count] ...]\n", name);
+	return 1;
+}
+
+/* A count of at least 1 in decimal at the start of text, end is set past it */
+static bool
+parse_count(const char *text, char **end, unsigned int *count)
+{
+	if (*text < '0' || *text > '9')
+		return false;
+	errno = 0;
+	unsigned long value = strtoul(text, end, 10);
+	if (errno || value == 0 || value > UINT_MAX)
+		return false;
+	*count = value;
+	return true;
+}
+
+/* Read a period argument, frames optionally followed by :count */
+static bool
+parse_period(const char *text, struct sound_config *config)
+{
+	char *end;
+	config->periods = 0;
+	return parse_count(text, &end, &config->period_frames)
+	    && (*end != ':' || parse_count(end + 1, &end, &config->periods))
+	    && *end == '\0';
+}
+
+static void
+sleep_ns(long ns)
+{
+	struct timespec time = { ns / 1000000000, ns % 1000000000 };
+	nanosleep(&time, NULL);
+}
+
+static int
+run(struct sound_config config)
+{
+	if (sound_init(&config) < 0 || sound_wait() < 0) {
+		fprintf(stderr, "no audio device\n");
+		return -1;
+	}
+	for (int n = 0; n < TRIGGERS; ++n) {
+		sound_play(SFX_HARDDROP);
+		sleep_ns(INTERVAL);
+	}
+	sound_destroy();
+
+	struct sound_latency latency;
+	sound_latency(&latency);
+	if (!latency.count) {
+		fprintf(stderr, "harddrop.ogg did not load\n");
+		return -1;
+	}
+	printf("period %5u x %u  p50 %8.1f us  p90 %8.1f us  p99 %8.1f us  max %8.1f us\n",
+	       config.period_frames, config.periods, latency.p50 / 1e3, latency.p90 / 1e3,
+	       latency.p99 / 1e3, latency.max / 1e3);
+	return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct sound_config config = { .null_device = true };
+	if (argc < 2) {
+		for (config.period_frames = 64; config.period_frames <= 1024; config.period_frames *= 2)
+			if (run(config) < 0)
+				return 1;
+		return 0;
+	}
+
+	/* check every argument before measuring anything */
+	for (int n = 1; n < argc; ++n)
+		if (!parse_period(argv[n], &config))
+			return usage(argv[0]);
+
+	for (int n = 1; n < argc; ++n) {
+		parse_period(argv[n], &config);
+		if (run(config) < 0)
+			return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,457 @@
+/* Perft for the placement generator: enumerate every sequence of placements
+ * of a fixed piece sequence to a given depth, count the leaves and time it.
+ *
+ * bench_perft [-b] [corpus]              check every position of a corpus file
+ * bench_perft [-b] depth pieces [board]  count a single position
+ *
+ * With -b the tree is walked with a brute force search through the controls_*
+ * functions instead, and every node is also compared with game_placements,
+ * spins and soft drops included, so the counts do not rest on the generator.
+ *
+ * Corpus lines are "name depth pieces board nodes", a board lists rows from
+ * the top separated by '/' with '#' for filled cells and is aligned to the
+ * bottom of the grid, '-' is the empty board. '#' starts a comment line. */
+#include "engine.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define MAX_DEPTH 16
+#define MAX_REPORTS 10 /* errors printed for each position */
+
+static const char PIECE_NAMES[] = "IJLOSTZ";
+
+/* one placement buffer per level so the recursion never allocates */
+static struct placement (*levels)[MAX_PLACEMENTS];
+static long calls; /* of the generator, every inner node of the tree */
+static bool brute; /* -b, walk the tree with the brute force search */
+static const char *position; /* name of the position being counted */
+static int errors;           /* found while counting it */
+
+static int
+piece_type(char c)
+{
+	const char *p = strchr(PIECE_NAMES, c);
+	return (c && p) ? p - PIECE_NAMES : -1;
+}
+
+/* Fill the grid from a board string, returns -1 when malformed */
+static int
+load_board(struct game_state *game, const char *board)
+{
+	if (strcmp(board, "-") == 0)
+		return 0;
+
+	int nrows = 1;
+	for (const char *c = board; *c; ++c)
+		nrows += *c == '/';
+	if (nrows > GRID_ROWS)
+		return -1;
+
+	int y = GRID_ROWS - nrows;
+	int x = 0;
+	for (const char *c = board; *c; ++c) {
+		if (*c == '/') {
+			if (x != GRID_COLS)
+				return -1;
+			++y;
+			x = 0;
+			continue;
+		}
+		if (x >= GRID_COLS || (*c != '#' && *c != '.'))
+			return -1;
+		if (*c == '#') {
+			game->rows[y] |= 1U << x;
+			game->colors[y][x] = I;
+			if (y < game->surface[x])
+				game->surface[x] = y;
+		}
+		++x;
+	}
+	return (x == GRID_COLS) ? 0 : -1;
+}
+
+/* Write the grid in the board format of the corpus */
+static void
+format_board(const struct game_state *game, char board[256])
+{
+	int y = 0;
+	while (y < GRID_ROWS && game->rows[y] == 0)
+		++y;
+	if (y == GRID_ROWS) {
+		strcpy(board, "-");
+		return;
+	}
+
+	char *c = board;
+	for (; y < GRID_ROWS; ++y) {
+		for (int x = 0; x < GRID_COLS; ++x)
+			*c++ = (game->rows[y] >> x) & 1 ? '#' : '.';
+		*c++ = '/';
+	}
+	c[-1] = '\0';
+}
+
+/* Print an error about a node of the tree along with its board */
+static void
+report(const struct game_state *game, const char *format, ...)
+{
+	if (errors++ >= MAX_REPORTS)
+		return;
+
+	char board[256];
+	format_board(game, board);
+
+	va_list args;
+	va_start(args, format);
+	printf("%-16s ", position);
+	vprintf(format, args);
+	printf(" on %s\n", board);
+	va_end(args);
+}
+
+/*** Brute force search ***/
+
+/* positions are searched with this much room around the grid */
+#define SEARCH_PAD  4
+#define SEARCH_COLS (GRID_COLS + 2 * SEARCH_PAD)
+#define SEARCH_ROWS (GRID_ROWS + 2 * SEARCH_PAD)
+#define SEARCH_SIZE (4 * SEARCH_ROWS * SEARCH_COLS * 3)
+
+/* a placement together with what makes it distinct, see placement_key */
+struct candidate {
+	uint64_t key;
+	struct placement placement;
+};
+
+static bool seen[4][SEARCH_ROWS][SEARCH_COLS][3];
+static struct placement queue[SEARCH_SIZE];
+static struct candidate found[SEARCH_SIZE], landed[SEARCH_SIZE], generated[MAX_PLACEMENTS];
+
+static int
+spin_index(enum action_type spin)
+{
+	return spin == TSPIN ? 2 : spin == MINI_TSPIN;
+}
+
+/* The cells and spin of a placement, the same for every rotation and
+ * position which covers the same cells */
+static uint64_t
+placement_key(const struct placement *placement)
+{
+	int cells[4];
+	for (int n = 0; n < 4; ++n) {
+		int x = placement->x + ROTATIONS[placement->type][placement->rotation][n][0];
+		int y = placement->y + ROTATIONS[placement->type][placement->rotation][n][1];
+		int cell = y * GRID_COLS + x;
+		int i = n;
+		for (; i > 0 && cells[i - 1] > cell; --i)
+			cells[i] = cells[i - 1];
+		cells[i] = cell;
+	}
+
+	uint64_t key = spin_index(placement->spin);
+	for (int n = 0; n < 4; ++n)
+		key = (key << 9) | cells[n];
+	return key;
+}
+
+static int
+compare_candidates(const void *a, const void *b)
+{
+	uint64_t x = ((const struct candidate *) a)->key;
+	uint64_t y = ((const struct candidate *) b)->key;
+	return (x > y) - (x < y);
+}
+
+/* Sort candidates and drop the duplicates, returns the new count */
+static int
+unique_candidates(struct candidate *candidates, int count)
+{
+	qsort(candidates, count, sizeof(*candidates), compare_candidates);
+	int unique = 0;
+	for (int n = 0; n < count; ++n)
+		if (unique == 0 || candidates[unique - 1].key != candidates[n].key)
+			candidates[unique++] = candidates[n];
+	return unique;
+}
+
+/* Press a control on the tetromino at a state, returns false when nothing
+ * moved. The spin of the new state is the one the control left, so moving
+ * after a rotation loses the spin like game_placements expects. */
+static bool
+press(struct game_state *work, const struct placement *from, int control, struct placement *to)
+{
+	work->tetromino.rotation = from->rotation;
+	work->tetromino.x = from->x;
+	work->tetromino.y = from->y;
+	work->tspin = NONE;
+
+	switch (control) {
+	case 0: controls_move(work, -1, 0); break;
+	case 1: controls_move(work, 1, 0); break;
+	case 2: controls_rotate(work, -1); break;
+	case 3: controls_rotate(work, 1); break;
+	case 4: controls_move(work, 0, 1); break;
+	}
+
+	*to = *from;
+	to->rotation = work->tetromino.rotation;
+	to->x = work->tetromino.x;
+	to->y = work->tetromino.y;
+	to->spin = work->tspin;
+	return to->rotation != from->rotation || to->x != from->x || to->y != from->y;
+}
+
+/* Breadth first search through the controls from the spawn. With a soft
+ * drop every state at rest is a placement, without one every state is
+ * hard dropped. Returns the candidates found, duplicates included. */
+static int
+search(const struct game_state *game,
+       enum tetromino_type type,
+       bool soft_drop,
+       struct candidate *candidates)
+{
+	if (game->has_lost)
+		return 0;
+
+	struct game_state work = *game;
+	spawn_tetromino(&work, type);
+	for (int n = 0; n < 4; ++n) {
+		int x = block_x(&work, 0, n);
+		int y = block_y(&work, 0, n);
+		if (x < 0 || x >= GRID_COLS || y < 0 || y >= GRID_ROWS
+		    || grid_cell(&work, x, y) != EMPTY)
+			return 0;
+	}
+
+	memset(seen, 0, sizeof(seen));
+	int head = 0, tail = 0, count = 0;
+	queue[tail++] = (struct placement) {
+		.type = type, .x = work.tetromino.x, .y = work.tetromino.y, .spin = NONE,
+	};
+	seen[0][work.tetromino.y + SEARCH_PAD][work.tetromino.x + SEARCH_PAD][0] = true;
+
+	while (head < tail) {
+		struct placement state = queue[head++], next;
+
+		/* where the state locks, without a soft drop it hard drops first */
+		struct placement rest = state;
+		bool falls = press(&work, &state, 4, &next);
+		if (falls && !soft_drop) {
+			rest = next;
+			while (press(&work, &rest, 4, &next))
+				rest = next;
+		}
+		if (!falls || !soft_drop) {
+			candidates[count].placement = rest;
+			candidates[count].key = placement_key(&rest);
+			++count;
+		}
+
+		for (int control = 0; control < (soft_drop ? 5 : 4); ++control) {
+			if (!press(&work, &state, control, &next))
+				continue;
+			bool *visited = &seen[next.rotation][next.y + SEARCH_PAD]
+					     [next.x + SEARCH_PAD][spin_index(next.spin)];
+			if (!*visited) {
+				*visited = true;
+				queue[tail++] = next;
+			}
+		}
+	}
+	return count;
+}
+
+/* Every placement reachable through the controls, sorted by placement_key,
+ * soft_drop is set where no hard drop reaches it */
+static int
+brute_placements(const struct game_state *game,
+		 enum tetromino_type type,
+		 struct placement placements[MAX_PLACEMENTS])
+{
+	int count = unique_candidates(found, search(game, type, true, found));
+	int hard = unique_candidates(landed, search(game, type, false, landed));
+
+	for (int n = 0; n < count; ++n) {
+		placements[n] = found[n].placement;
+		placements[n].soft_drop = !bsearch(&found[n], landed, hard,
+						   sizeof(*landed), compare_candidates);
+	}
+	return count;
+}
+
+/* Compare game_placements with the brute force placements of a node */
+static void
+check_placements(const struct game_state *game,
+		 enum tetromino_type type,
+		 const struct placement *placements,
+		 int count)
+{
+	static struct placement output[MAX_PLACEMENTS];
+	int total = game_placements(game, type, output);
+	for (int n = 0; n < total; ++n) {
+		generated[n].placement = output[n];
+		generated[n].key = placement_key(&output[n]);
+	}
+	int unique = unique_candidates(generated, total);
+	if (unique != total)
+		report(game, "game_placements lists %d %c placements twice",
+		       total - unique, PIECE_NAMES[type]);
+
+	/* both lists are sorted, walk them side by side */
+	int i = 0, j = 0;
+	while (i < count || j < unique) {
+		uint64_t want = i < count ? placement_key(&placements[i]) : UINT64_MAX;
+		uint64_t have = j < unique ? generated[j].key : UINT64_MAX;
+		const struct placement *p = (want <= have) ? &placements[i] : &generated[j].placement;
+		const char *problem = NULL;
+		if (want < have)
+			problem = "misses";
+		else if (want > have)
+			problem = "adds";
+		else if (p->soft_drop != generated[j].placement.soft_drop)
+			problem = "gets the soft drop wrong for";
+
+		if (problem)
+			report(game, "game_placements %s %c rotation %d at %d,%d spin %d",
+			       problem, PIECE_NAMES[type], p->rotation, p->x, p->y, p->spin);
+		i += want <= have;
+		j += have <= want;
+	}
+}
+
+static long
+perft(const struct game_state *game, const int *pieces, int depth)
+{
+	struct placement *placements = levels[depth];
+	++calls;
+	int count;
+	if (brute) {
+		count = brute_placements(game, pieces[0], placements);
+		check_placements(game, pieces[0], placements, count);
+	} else {
+		count = game_placements(game, pieces[0], placements);
+	}
+	if (depth == 1)
+		return count;
+
+	long nodes = 0;
+	for (int n = 0; n < count; ++n) {
+		struct game_state child = *game;
+		spawn_tetromino(&child, pieces[0]);
+		if (!game_place(&child, &placements[n])) {
+			report(game, "game_place rejects %c rotation %d at %d,%d spin %d",
+			       PIECE_NAMES[pieces[0]], placements[n].rotation,
+			       placements[n].x, placements[n].y, placements[n].spin);
+			continue;
+		}
+		nodes += perft(&child, pieces + 1, depth - 1);
+	}
+	return nodes;
+}
+
+/* Count a position and print the result, returns the number of nodes or -1 */
+static long
+run(const char *name, int depth, const char *sequence, const char *board)
+{
+	int pieces[MAX_DEPTH];
+	int length = strlen(sequence);
+	if (depth < 1 || depth > MAX_DEPTH || length < depth) {
+		fprintf(stderr, "%s: depth must be 1-%d and within the pieces\n",
+			name, MAX_DEPTH);
+		return -1;
+	}
+	for (int n = 0; n < depth; ++n) {
+		if ((pieces[n] = piece_type(sequence[n])) < 0) {
+			fprintf(stderr, "%s: bad piece '%c'\n", name, sequence[n]);
+			return -1;
+		}
+	}
+
+	struct game_state game;
+	game_set_to_default(&game, 0);
+	if (load_board(&game, board) < 0) {
+		fprintf(stderr, "%s: bad board\n", name);
+		return -1;
+	}
+
+	struct timespec start, end;
+	position = name;
+	errors = 0;
+	calls = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	long nodes = perft(&game, pieces, depth);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+	printf("%-16s depth %2d  nodes %12ld  %8.3fs  %12.0f nodes/s  %10.0f calls/s\n",
+	       name, depth, nodes, seconds, seconds > 0 ? nodes / seconds : 0.0,
+	       seconds > 0 ? calls / seconds : 0.0);
+	if (errors) {
+		printf("%-16s %d errors\n", name, errors);
+		return -1;
+	}
+	return nodes;
+}
+
+static int
+run_corpus(const char *path)
+{
+	FILE *file = fopen(path, "r");
+	if (!file) {
+		perror(path);
+		return 1;
+	}
+
+	char line[512], name[64], sequence[MAX_DEPTH + 1], board[256];
+	int depth, failures = 0, positions = 0;
+	long expected;
+	while (fgets(line, sizeof(line), file)) {
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+		if (sscanf(line, "%63s %d %16s %255s %ld",
+			   name, &depth, sequence, board, &expected) != 5) {
+			fprintf(stderr, "%s: malformed line: %s", path, line);
+			++failures;
+			continue;
+		}
+
+		++positions;
+		long nodes = run(name, depth, sequence, board);
+		if (nodes != expected) {
+			printf("%-16s FAILED, expected %ld\n", name, expected);
+			++failures;
+		}
+	}
+	fclose(file);
+
+	printf("%d positions, %d failed\n", positions, failures);
+	return failures != 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+	levels = malloc(sizeof(*levels) * (MAX_DEPTH + 1));
+	if (!levels)
+		return 1;
+
+	if (argc > 1 && strcmp(argv[1], "-b") == 0) {
+		brute = true;
+		--argc;
+		++argv;
+	}
+
+	int status;
+	if (argc >= 3)
+		status = run("position", atoi(argv[1]), argv[2], argc > 3 ? argv[3] : "-") < 0;
+	else
+		status = run_corpus(argc == 2 ? argv[1] : "perft.txt");
+
+	free(levels);
+	return status;
+}
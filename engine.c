@@ -0,0 +1,1177 @@
+#include "engine.h"
+#include "rotations.h"
+
+#include <assert.h>
+#include <string.h>
+
+static const int ACTION_POINTS[] = { FOR_EACH_ACTION(GENERATE_POINTS) };
+
+const int ROTATIONS[7][4][4][2] = ROTATIONS_TABLE;
+
+/* Occupancy of a tetromino rotation as row masks, one set for each legal
+ * x position so out of bounds columns never need checking. See gentables.c */
+struct piece_mask {
+	int x_min, x_max; /* legal range for the tetromino x position */
+	int top, bottom;  /* first and last rows holding blocks */
+	int width;        /* columns spanned, starting from column x - x_min */
+	int profile[4];   /* lowest block row in each spanned column */
+	int canon_rotation, canon_x, canon_y; /* same cells, moved by x and y */
+	uint16_t rows[GRID_COLS][4];
+};
+
+#include "masks.h"
+
+/* KICKTABLE[is_I piece][direction][rotation][tests][offsets]
+ *
+ * Tests are in order from:
+ * wallkicks (left and right), floorkicks, right well kicks, left well kicks
+ *
+ * The tests are alternative rotations when the natural one fails and are
+ * chosen based on: the current rotation and the desired rotation (from)>>(to)
+ *
+ * These are organized so the right rotation can be indexed using the
+ * the current rotation of the tetromino.
+ */
+static const int KICKTABLE[2][2][4][4][2] = {
+	/* tests for "J L S Z T" */
+	{
+		/* counterclockwise */
+		{{{ 1, 0}, { 1, -1}, {0,  2}, { 1,  2}},  // 0>>3
+		 {{ 1, 0}, { 1,  1}, {0, -2}, { 1, -2}},  // 1>>0
+		 {{-1, 0}, {-1, -1}, {0,  2}, {-1,  2}},  // 2>>1
+		 {{-1, 0}, {-1,  1}, {0, -2}, {-1, -2}}}, // 3>>2
+		/* clockwise */
+		{{{-1, 0}, {-1, -1}, {0,  2}, {-1,  2}},  // 0>>1
+		 {{ 1, 0}, { 1,  1}, {0, -2}, { 1, -2}},  // 1>>2
+		 {{ 1, 0}, { 1, -1}, {0,  2}, { 1,  2}},  // 2>>3
+		 {{-1, 0}, {-1,  1}, {0, -2}, {-1, -2}}}, // 3>>0
+	},
+	/* tests for "I" */
+	{
+		/* counterclockwise */
+		{{{-1, 0}, { 2, 0}, {-1, -2}, { 2,  1}},  // 0>>3
+		 {{ 2, 0}, {-1, 0}, { 2, -1}, {-1,  2}},  // 1>>0
+		 {{ 1, 0}, {-2, 0}, { 1,  2}, {-2, -1}},  // 2>>1
+		 {{-2, 0}, { 1, 0}, {-2,  1}, { 1, -2}}}, // 3>>2
+		/* clockwise */
+		{{{-2, 0}, { 1, 0}, {-2,  1}, { 1, -2}},  // 0>>1
+		 {{-1, 0}, { 2, 0}, {-1, -2}, { 2,  1}},  // 1>>2
+		 {{ 2, 0}, {-1, 0}, { 2, -1}, {-1,  2}},  // 2>>3
+		 {{ 1, 0}, {-2, 0}, { 1,  2}, {-2, -1}}}, // 3>>0
+	}
+};
+
+/* Gravity in fractions of a cell per tick based on level, from the time for
+ * a piece to drop which is constant past level 20 */
+static const uint32_t gravity_table[20] = {
+	16777,    21157,    27156,    35490,    47233,    64035,    88450,
+	124525,   178709,   261531,   390349,   594515,   924365,   1466540,
+	2376376,  3938314,  6657625,  11491244, 20460020, 36472209,
+};
+
+/* Spawn position of a tetromino, the O-piece has a different placement */
+#define SPAWN_Y 1
+
+static inline int
+spawn_x(enum tetromino_type type)
+{
+	return (type == O) ? 4 : 3;
+}
+
+/* Actions which can maintain a back-to-back */
+static bool
+is_difficult(enum action_type type)
+{
+	switch (type) {
+	case QUAD:
+	case MINI_TSPIN_SINGLE:
+	case MINI_TSPIN_DOUBLE:
+	case TSPIN_SINGLE:
+	case TSPIN_DOUBLE:
+	case TSPIN_TRIPLE:
+	case PERFECT_QUAD:
+		return true;
+	default:
+		return false;
+	}
+	return false;
+}
+
+/* PCG32, every game owns one so games replay from their seed and never
+ * share state between threads */
+static uint32_t
+random_next(uint64_t *state)
+{
+	uint64_t old = *state;
+	*state = old * 6364136223846793005ULL + 1442695040888963407ULL;
+	uint32_t xorshifted = ((old >> 18) ^ old) >> 27;
+	uint32_t rot = old >> 59;
+	return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+}
+
+/* Random number in [0, bound) */
+static inline int
+random_below(uint64_t *state, int bound)
+{
+	return ((uint64_t) random_next(state) * bound) >> 32;
+}
+
+static void
+shuffle_bag(uint64_t *random, enum tetromino_type bag[BAGSIZE])
+{
+	int j, tmp;
+	for (int i = BAGSIZE - 1; i > 0; --i) {
+		j = random_below(random, i + 1);
+		tmp = bag[j];
+		bag[j] = bag[i];
+		bag[i] = tmp;
+	}
+}
+
+/* record an action for the frontend to announce */
+static void
+announce(struct game_state *game, enum action_type type, bool back_to_back)
+{
+	game->action = type;
+	game->action_back_to_back = back_to_back;
+	game->action_tick = game->tick;
+	++game->action_serial;
+}
+
+/*** Grid ***/
+
+static inline bool
+block_valid(const struct game_state *game, int x, int y)
+{
+	return x >= 0 && x < GRID_COLS
+	    && y >= 0 && y < GRID_ROWS
+	    && !(game->rows[y] & (1U << x));
+}
+
+static inline bool
+row_filled(const struct game_state *game, int row)
+{
+	return game->rows[row] == ROW_FULL;
+}
+
+static inline bool
+row_empty(const struct game_state *game, int row)
+{
+	return game->rows[row] == 0;
+}
+
+/* Move rows [from, to) down by the given amount in one block */
+static void
+shift_rows(struct game_state *game, int from, int to, int by)
+{
+	if (to <= from)
+		return;
+	memmove(&game->rows[from + by], &game->rows[from],
+		(to - from) * sizeof(game->rows[0]));
+	memmove(game->colors[from + by], game->colors[from],
+		(to - from) * sizeof(game->colors[0]));
+}
+
+/* Collision kernel, check if a tetromino fits the grid at the given position */
+static inline bool
+tetromino_fits(const struct game_state *game,
+	       enum tetromino_type type,
+	       int rotation,
+	       int x,
+	       int y)
+{
+	const struct piece_mask *piece = &PIECE_MASKS[type][rotation];
+	if (x < piece->x_min || x > piece->x_max)
+		return false;
+	if (y + piece->top < 0 || y + piece->bottom >= GRID_ROWS)
+		return false;
+
+	const uint16_t *mask = piece->rows[x - piece->x_min];
+	for (int r = piece->top; r <= piece->bottom; ++r) {
+		if (game->rows[y + r] & mask[r])
+			return false;
+	}
+	return true;
+}
+
+/* Check if the current tetromino is valid at the given rotation and offset */
+static inline bool
+tetromino_valid(const struct game_state *game, int rotation, int x_offset, int y_offset)
+{
+	return tetromino_fits(game,
+			      game->tetromino.type,
+			      rotation,
+			      game->tetromino.x + x_offset,
+			      game->tetromino.y + y_offset);
+}
+
+/* Rows a tetromino can fall from the given position before it lands.
+ *
+ * Constant time from the column surfaces and the bottom profile, unless
+ * the tetromino is tucked under an overhang where the grid is scanned. */
+static int
+drop_distance(const struct game_state *game,
+	      enum tetromino_type type,
+	      int rotation,
+	      int x,
+	      int y)
+{
+	const struct piece_mask *piece = &PIECE_MASKS[type][rotation];
+	const signed char *surface = &game->surface[x - piece->x_min];
+	int distance = GRID_ROWS;
+
+	for (int i = 0; i < piece->width; ++i) {
+		int gap = surface[i] - 1 - (y + piece->profile[i]);
+		if (gap < 0)
+			goto scan;
+		distance = gap < distance ? gap : distance;
+	}
+	return distance;
+
+	scan:
+	distance = 0;
+	while (tetromino_fits(game, type, rotation, x, y + distance + 1))
+		++distance;
+	return distance;
+}
+
+/* Columns the current tetromino can slide in a direction before it hits a
+ * block or a wall, from the nearest obstacle beside each of its rows */
+static int
+slide_distance(const struct game_state *game, int direction)
+{
+	const struct tetromino *tetromino = &game->tetromino;
+	const struct piece_mask *piece = &PIECE_MASKS[tetromino->type][tetromino->rotation];
+	const uint16_t *mask = piece->rows[tetromino->x - piece->x_min];
+	int distance = GRID_COLS;
+
+	for (int r = piece->top; r <= piece->bottom; ++r) {
+		/* columns past the right wall count as filled */
+		unsigned int filled = game->rows[tetromino->y + r] | ~ROW_FULL;
+		int gap;
+		if (direction > 0) {
+			int edge = 31 - __builtin_clz(mask[r]);
+			gap = __builtin_ctz(filled & ~((2U << edge) - 1)) - edge - 1;
+		} else {
+			int edge = __builtin_ctz(mask[r]);
+			unsigned int left = filled & ((1U << edge) - 1);
+			gap = left ? edge - (32 - __builtin_clz(left)) : edge;
+		}
+		distance = gap < distance ? gap : distance;
+	}
+	return distance;
+}
+
+/* Recompute the surface of a column from the given row downwards */
+static void
+rescan_surface(struct game_state *game, int col, int from)
+{
+	int y = from;
+	while (y < GRID_ROWS && !(game->rows[y] & (1U << col)))
+		++y;
+	game->surface[col] = y;
+}
+
+/* T-spin from the corners around a T-piece at the given position. The
+ * kick which upgrades a mini to a full T-spin is left to the caller. */
+static enum action_type
+tspin_corners(const struct game_state *game, int rotation, int x, int y)
+{
+	/* list of corners clockwise, starting index is current rotation */
+	static const int corners[4][2] = { {0, 0}, {2, 0}, {2, 2}, {0, 2} };
+	/* filled corners: front-left, front-right, back-right, back-left */
+	bool filled[4];
+
+	for (int i = 0; i < 4; ++i) {
+		int index = (rotation + i) & 3;
+		filled[i] = !block_valid(game,
+					 corners[index][0] + x,
+			   		 corners[index][1] + y);
+	}
+
+	if (filled[0] && filled[1] && (filled[2] || filled[3]))
+		return TSPIN;
+	if (filled[2] && filled[3] && (filled[0] || filled[1]))
+		return MINI_TSPIN;
+	return NONE;
+}
+
+static void
+check_tspin(struct game_state *game, int kick_test)
+{
+	game->tspin = tspin_corners(game,
+				    game->tetromino.rotation,
+				    game->tetromino.x,
+				    game->tetromino.y);
+	if (game->tspin == MINI_TSPIN && kick_test == 3)
+		game->tspin = TSPIN;
+
+	if (game->tspin != NONE)
+		announce(game, game->tspin, false);
+}
+
+/*** Game state ***/
+
+/* Updates the ghost piece, recalculate when position of piece changes */
+static void
+update_ghost(struct game_state *game)
+{
+	game->tetromino.ghost_y = game->tetromino.y
+		+ drop_distance(game,
+				game->tetromino.type,
+				game->tetromino.rotation,
+				game->tetromino.x,
+				game->tetromino.y);
+	++game->generation[CHANGE_PIECE];
+}
+
+static enum tetromino_type
+next_tetromino(struct game_state *game)
+{
+	++game->generation[CHANGE_QUEUE];
+
+	/* replace with a piece from the shuffle bag to allow for previews */
+	enum tetromino_type type = game->bag[game->bag_index];
+	game->bag[game->bag_index] = game->shuffle_bag[game->bag_index];
+
+	game->bag_index = (game->bag_index + 1) % BAGSIZE;
+	/* shuffle the shuffle_bag once it is exhausted */
+	if (game->bag_index == 0)
+		shuffle_bag(&game->random, game->shuffle_bag);
+
+	return type;
+}
+
+/* Spawn a new tetromino piece with the given type onto the grid */
+void
+spawn_tetromino(struct game_state *game, enum tetromino_type type)
+{
+	game->tetromino.type = type;
+	game->tetromino.rotation = 0;
+
+	game->tetromino.x = spawn_x(type);
+	game->tetromino.y = SPAWN_Y;
+	update_ghost(game);
+
+	game->accumulator = 0;
+	game->piece_lock = false;
+	game->move_reset = 0;
+	game->tspin = NONE;
+}
+
+/* updates score and levels after line clears */
+void
+update_score(struct game_state *game, int lines)
+{
+	/* where there are no tspin, game->tspin is NONE or 0 */
+	enum action_type action = lines + game->tspin;
+	bool back_to_back = is_difficult(action) && game->back_to_back;
+	double score = ACTION_POINTS[action] * ((back_to_back) ? 1.5 : 1);
+
+	/* combo bonuses */
+	score += 50 * (game->combo < 0 ? 0 : game->combo);
+	/* perfect line clear bonuses are added to regular clear bonuses */
+	if (row_empty(game, GRID_ROWS - 1))
+		score += (back_to_back) ? 3200 : ACTION_POINTS[PERFECT_SINGLE + lines];
+
+	game->score += (int) (score * game->level);
+	announce(game, action, back_to_back);
+
+	game->lines_cleared += lines;
+	game->level = (game->lines_cleared / 10) + 1; /* new level every 10 lines */
+	game->combo = (lines == 0) ? -1 : game->combo + 1;
+	++game->generation[CHANGE_STATS];
+	if (lines)
+		game->events |= EVENT_LINE_CLEAR;
+	if (game->tspin != NONE)
+		game->events |= EVENT_TSPIN;
+	/* t-spins and mini-tspins do not break the chain */
+	if (!back_to_back && game->back_to_back)
+		game->back_to_back = (action == TSPIN || action == MINI_TSPIN);
+	else
+		game->back_to_back = is_difficult(action);
+}
+
+/* Clear filled rows at or above row and shifts rows down. Returns lines cleared */
+int
+update_rows(struct game_state *game, int row)
+{
+	uint32_t filled = 0;
+	for (int y = 0; y <= row; ++y)
+		filled |= (uint32_t) row_filled(game, y) << y;
+	if (!filled)
+		return 0;
+
+	/* runs of rows between cleared rows fall by the number of cleared rows
+	 * beneath them, going upwards so a run only lands on moved rows */
+	int lines = 0;
+	int top = row; /* highest cleared row */
+	for (int y = row; y >= 0; --y) {
+		if (!((filled >> y) & 1))
+			continue;
+		if (lines)
+			shift_rows(game, y + 1, top, lines);
+		top = y;
+		++lines;
+	}
+	shift_rows(game, 0, top, lines);
+	memset(game->rows, 0, lines * sizeof(game->rows[0]));
+	memset(game->colors, EMPTY, lines * sizeof(game->colors[0]));
+
+	/* every column reaches the cleared rows, surfaces above them move down
+	 * while those which were inside them need to be found again */
+	for (int x = 0; x < GRID_COLS; ++x) {
+		if (game->surface[x] < top)
+			game->surface[x] += lines;
+		else
+			rescan_surface(game, x, top);
+	}
+
+	return lines;
+}
+
+/* Place the active tetromino and handle line clears */
+void
+place_tetromino(struct game_state *game)
+{
+	int clear_begin = -1;
+	for (int n = 0; n < 4; ++n) {
+		int x = block_x(game, game->tetromino.rotation, n);
+		int y = block_y(game, game->tetromino.rotation, n);
+		game->rows[y] |= 1U << x;
+		game->colors[y][x] = game->tetromino.type;
+		if (y < game->surface[x])
+			game->surface[x] = y;
+		clear_begin = (row_filled(game, y) && y > clear_begin) ? y : clear_begin;
+	}
+	++game->generation[CHANGE_BOARD];
+
+	int lines = (clear_begin != -1) ? update_rows(game, clear_begin) : 0;
+	update_score(game, lines);
+
+	/* check for overflow only after lines have been cleared */
+	if (!row_empty(game, 1)) {
+		game->has_lost = true;
+		return;
+	}
+
+	game->has_held = false;
+	spawn_tetromino(game, next_tetromino(game));
+}
+
+/*** Game controls ***/
+
+/* Move a tetromino already known to fit at the offset */
+static void
+move_tetromino(struct game_state *game, int x_offset, int y_offset)
+{
+	game->tetromino.x += x_offset;
+	game->tetromino.y += y_offset;
+	game->score += y_offset;
+	game->generation[CHANGE_STATS] += y_offset != 0;
+	update_ghost(game);
+
+	if (game->piece_lock && ++game->move_reset < 15)
+		game->piece_lock = false;
+}
+
+void
+controls_move(struct game_state *game, int x_offset, int y_offset)
+{
+	assert(y_offset >= 0 && "tetromino can not be moved up");
+	if (tetromino_valid(game, game->tetromino.rotation, x_offset, y_offset))
+		move_tetromino(game, x_offset, y_offset);
+}
+
+/* Press or release a direction, -1 or 1. A press moves at once and keeps
+ * shifting from game_update until the release. */
+void
+controls_shift(struct game_state *game, int direction, bool held)
+{
+	int side = direction > 0;
+	game->shift_held[side] = held;
+	if (held) {
+		game->shift = direction;
+		game->shift_start = game->tick;
+		controls_move(game, direction, 0);
+	} else if (game->shift == direction) {
+		/* the other direction takes over and charges again */
+		game->shift = game->shift_held[!side] ? -direction : 0;
+		game->shift_start = game->tick;
+	}
+}
+
+void
+controls_rotate(struct game_state *game, int rotate_by)
+{
+	int rotation = (game->tetromino.rotation + rotate_by) & 3;
+	int kick_test = 0;
+
+	/* perform natural rotation */
+	if (tetromino_valid(game, rotation, 0, 0))
+		goto success;
+
+	/* natural rotation failed, attempt kicktable rotations */
+	int direction = rotate_by < 0 ? 0 : 1;
+	bool is_I = game->tetromino.type == I;
+	for (int n = 0; n < 4; ++n) {
+		const int *offset = KICKTABLE[is_I][direction][game->tetromino.rotation][n];
+
+		if (tetromino_valid(game, rotation, offset[0], offset[1])) {
+			game->tetromino.x += offset[0];
+			game->tetromino.y += offset[1];
+			kick_test = n;
+			goto success;
+		}
+	}
+
+	return;
+	success: {
+		game->tetromino.rotation = rotation;
+		game->events |= EVENT_ROTATE;
+		update_ghost(game);
+
+		if (game->tetromino.type == T)
+			check_tspin(game, kick_test);
+
+		if (game->piece_lock && ++game->move_reset < 15)
+			game->piece_lock = false;
+	}
+}
+
+void
+controls_harddrop(struct game_state *game)
+{
+	/* add two points for each cell harddropped */
+	game->score += (game->tetromino.ghost_y - game->tetromino.y) * 2;
+	game->tetromino.y = game->tetromino.ghost_y;
+	game->events |= EVENT_HARDDROP;
+	place_tetromino(game);
+}
+
+void
+controls_hold(struct game_state *game)
+{
+	if (game->has_held)
+		return;
+
+	game->has_held = true;
+	enum tetromino_type current = game->hold;
+	if (current == EMPTY)
+		current = next_tetromino(game);
+	game->hold = game->tetromino.type;
+	game->events |= EVENT_HOLD;
+	++game->generation[CHANGE_HOLD];
+
+	spawn_tetromino(game, current);
+}
+
+/* Check a placement is a legal resting spot with a believable spin */
+static bool
+placement_valid(const struct game_state *game, const struct placement *placement)
+{
+	int rot = placement->rotation;
+	int x = placement->x;
+	int y = placement->y;
+
+	if (placement->type < I || placement->type > Z)
+		return false;
+	if (rot < 0 || rot > 3 || !tetromino_fits(game, placement->type, rot, x, y))
+		return false;
+	/* the tetromino has to be resting on something */
+	if (tetromino_fits(game, placement->type, rot, x, y + 1))
+		return false;
+
+	if (placement->spin == NONE)
+		return true;
+	if (placement->type != T)
+		return false;
+
+	/* a kick can upgrade a mini to a full tspin, but never the other way */
+	enum action_type corners = tspin_corners(game, rot, x, y);
+	return corners == placement->spin
+	    || (corners == MINI_TSPIN && placement->spin == TSPIN);
+}
+
+/* Lock a tetromino at its final position without simulating the keys to get
+ * there. The placement can use the held tetromino if holding is allowed.
+ * No drop points are given. Returns false and leaves the game untouched if
+ * the placement is not legal. */
+bool
+game_place(struct game_state *game, const struct placement *placement)
+{
+	if (game->has_lost || !placement_valid(game, placement))
+		return false;
+
+	if (placement->type != game->tetromino.type) {
+		enum tetromino_type held = game->hold;
+		if (held == EMPTY)
+			held = game->bag[game->bag_index];
+		if (game->has_held || held != placement->type)
+			return false;
+		controls_hold(game);
+	}
+
+	game->tetromino.rotation = placement->rotation;
+	game->tetromino.x = placement->x;
+	game->tetromino.y = placement->y;
+	game->tspin = placement->spin;
+	place_tetromino(game);
+	return true;
+}
+
+/* Reset to a new game, the same seed always plays out the same game */
+void
+game_set_to_default(struct game_state *game, uint64_t seed)
+{
+	*game = (struct game_state) {0};
+	game->seed = seed;
+	random_next(&game->random);
+	game->random += seed;
+	random_next(&game->random);
+	game->hold = EMPTY;
+	game->tspin = NONE;
+	game->level = 1;
+	game->combo = -1;
+	game->das = AUTO_SHIFT_DELAY;
+	game->arr = AUTO_REPEAT_RATE;
+
+	memset(game->colors, EMPTY, sizeof(game->colors));
+	memset(game->surface, GRID_ROWS, sizeof(game->surface));
+
+	enum tetromino_type initial_bag[BAGSIZE] = { I, J, L, O, S, T, Z };
+	memcpy(game->bag, initial_bag, sizeof(initial_bag));
+	memcpy(game->shuffle_bag, initial_bag, sizeof(initial_bag));
+	shuffle_bag(&game->random, game->bag);
+	shuffle_bag(&game->random, game->shuffle_bag);
+
+	spawn_tetromino(game, next_tetromino(game));
+}
+
+/* Held direction repeats on this tick */
+static inline bool
+shift_due(const struct game_state *game)
+{
+	uint64_t elapsed = game->tick - game->shift_start;
+	if (elapsed < (uint64_t) game->das)
+		return false;
+	return game->arr == 0 || (elapsed - game->das) % game->arr == 0;
+}
+
+/* Advance auto shift, gravity and autoplacement by one tick */
+void
+game_update(struct game_state *game)
+{
+	++game->tick;
+	if (game->has_lost)
+		return;
+
+	/* without a repeat rate the tetromino goes to the wall in one move */
+	if (game->shift && shift_due(game)) {
+		if (game->arr == 0) {
+			int distance = slide_distance(game, game->shift);
+			if (distance)
+				move_tetromino(game, game->shift * distance, 0);
+		} else {
+			controls_move(game, game->shift, 0);
+		}
+	}
+
+	int i = game->level > 20 ? 19 : game->level - 1;
+	game->accumulator += gravity_table[i];
+
+	/* every whole cell gathered falls at once up to the ghost, the cells
+	 * past it are dropped so resting never stores up gravity */
+	uint64_t cells = (game->accumulator - 1) / GRAVITY_CELL;
+	game->accumulator -= cells * GRAVITY_CELL;
+
+	/* do gravity, otherwise start autoplacement */
+	int fall = game->tetromino.ghost_y - game->tetromino.y;
+	if (fall > 0) {
+		if (cells) {
+			game->tetromino.y += cells < (uint64_t) fall ? (int) cells : fall;
+			++game->generation[CHANGE_PIECE];
+		}
+	} else {
+		if (!game->piece_lock) {
+			game->piece_lock = true;
+			game->lock_start = game->tick;
+		}
+	}
+
+	/* piece autoplacement is independent of gravity */
+	if (game->piece_lock && game->tick - game->lock_start > LOCK_DELAY)
+		place_tetromino(game);
+}
+
+/* Ticks until the next update that changes the game on its own, an auto
+ * shift, a gravity step or an autoplacement. Nothing happens after a loss,
+ * UINT64_MAX then. */
+uint64_t
+game_next_event(const struct game_state *game)
+{
+	if (game->has_lost)
+		return UINT64_MAX;
+
+	uint64_t ticks = UINT64_MAX;
+	if (game->piece_lock)
+		ticks = game->lock_start + LOCK_DELAY + 1 - game->tick;
+
+	if (game->tetromino.ghost_y > game->tetromino.y) {
+		int i = game->level > 20 ? 19 : game->level - 1;
+		uint64_t gravity = 1;
+		if (game->accumulator <= GRAVITY_CELL)
+			gravity = (GRAVITY_CELL - game->accumulator) / gravity_table[i] + 1;
+		if (gravity < ticks)
+			ticks = gravity;
+	} else if (!game->piece_lock) {
+		ticks = 1; /* the lock delay starts with the next update */
+	}
+
+	/* a shift against a wall changes nothing until something else does */
+	if (game->shift && tetromino_valid(game, game->tetromino.rotation, game->shift, 0)) {
+		uint64_t elapsed = game->tick - game->shift_start;
+		uint64_t shift = 1;
+		if (elapsed < (uint64_t) game->das)
+			shift = game->das - elapsed;
+		else if (game->arr)
+			shift = game->arr - (elapsed - game->das) % game->arr;
+		if (shift < ticks)
+			ticks = shift;
+	}
+	return ticks;
+}
+
+/* Advance the game by a number of ticks, headless callers can run it as
+ * fast as they like while the frontend follows the wall clock */
+void
+game_advance(struct game_state *game, uint64_t ticks)
+{
+	while (ticks--)
+		game_update(game);
+}
+
+/*** Move generation ***/
+
+/* Positions are searched a row of x positions at a time for each rotation
+ * and y. Bit i of a row is x = i - X_BIAS and row j is y = j - Y_BIAS, the
+ * bias is enough for blocks offset from the tetromino origin. */
+#define X_BIAS   2
+#define Y_BIAS   2
+#define POS_ROWS (GRID_ROWS + Y_BIAS)
+
+struct positions {
+	uint16_t rows[4][POS_ROWS];
+};
+
+static inline uint16_t
+shift_x(unsigned int bits, int dx)
+{
+	return (dx >= 0) ? bits << dx : bits >> -dx;
+}
+
+/* Highest row with a filled cell, GRID_ROWS on an empty grid */
+static int
+stack_top(const struct game_state *game)
+{
+	int stack = 0;
+	while (stack < GRID_ROWS && !game->rows[stack])
+		++stack;
+	return stack;
+}
+
+/* Every position where the tetromino fits the grid */
+static void
+positions_fit(const struct game_state *game,
+	      enum tetromino_type type,
+	      int stack,
+	      struct positions *fit)
+{
+	/* rows above the stack fit wherever the tetromino is inside the grid */
+	for (int rot = 0; rot < 4; ++rot) {
+		const struct piece_mask *piece = &PIECE_MASKS[type][rot];
+		unsigned int span = piece->x_max - piece->x_min + 1;
+		uint16_t legal = ((1U << span) - 1) << (piece->x_min + X_BIAS);
+
+		for (int j = 0; j < POS_ROWS; ++j) {
+			int y = j - Y_BIAS;
+			uint16_t bits = legal;
+			if (y + piece->top < 0 || y + piece->bottom >= GRID_ROWS)
+				bits = 0;
+			if (y + piece->bottom < stack) {
+				fit->rows[rot][j] = bits;
+				continue;
+			}
+
+			/* block n lands on column i - X_BIAS + block x */
+			for (int n = 0; n < 4 && bits; ++n) {
+				const int *block = ROTATIONS[type][rot][n];
+				unsigned int free = ~game->rows[y + block[1]] & ROW_FULL;
+				bits &= shift_x(free, X_BIAS - block[0]);
+			}
+			fit->rows[rot][j] = bits;
+		}
+	}
+}
+
+/* Grow seeds left and right through the fitting positions of a row */
+static inline uint16_t
+fill_row(unsigned int seeds, unsigned int fit)
+{
+	/* a single run of positions, as above the stack */
+	if (!(fit & (fit + (fit & -fit))))
+		return (seeds & fit) ? fit : 0;
+
+	unsigned int left = seeds & fit, right = seeds & fit;
+	unsigned int left_fit = fit, right_fit = fit;
+	for (int step = 1; step < 16; step <<= 1) {
+		left |= left_fit & (left << step);
+		right |= right_fit & (right >> step);
+		left_fit &= left_fit << step;
+		right_fit &= right_fit >> step;
+	}
+	return (left | right) & fit;
+}
+
+static const int NATURAL[2] = { 0, 0 };
+
+/* Offset of kick n of a rotation, -1 is the rotation without a kick */
+static inline const int *
+kick_offset(bool is_I, int direction, int rot, int n)
+{
+	return (n < 0) ? NATURAL : KICKTABLE[is_I][direction][rot][n];
+}
+
+/* A search through the positions. Fresh holds the positions new to reach
+ * which have not been rotated from yet, only its pending rows are set. */
+struct flood {
+	const struct positions *fit;
+	bool is_I;
+	struct positions reach;
+	struct positions fresh;
+	uint32_t pending[4];
+};
+
+/* Rotate the fresh positions in the given rows of rotation rot, trying the
+ * kicks in the same order as controls_rotate */
+static void
+rotate_positions(struct flood *flood, int rot, int rotate_by, uint32_t rows)
+{
+	int target = (rot + rotate_by) & 3;
+	int direction = rotate_by < 0 ? 0 : 1;
+
+	for (; rows; rows &= rows - 1) {
+		int j = __builtin_ctz(rows);
+		uint16_t remaining = flood->fresh.rows[rot][j];
+		for (int n = -1; n < 4 && remaining; ++n) {
+			const int *offset = kick_offset(flood->is_I, direction, rot, n);
+			int ty = j + offset[1];
+			if (ty < 0 || ty >= POS_ROWS)
+				continue;
+
+			uint16_t moved = shift_x(remaining, offset[0]) & flood->fit->rows[target][ty];
+			uint16_t added = moved & ~flood->reach.rows[target][ty];
+			remaining &= ~shift_x(moved, -offset[0]);
+			if (!added)
+				continue;
+
+			uint32_t bit = 1U << ty;
+			flood->reach.rows[target][ty] |= added;
+			if (flood->pending[target] & bit)
+				added |= flood->fresh.rows[target][ty];
+			flood->fresh.rows[target][ty] = added;
+			flood->pending[target] |= bit;
+		}
+	}
+}
+
+/* Grow the pending rows of rotation rot sideways, and down if soft drops are
+ * allowed. Returns the rows which gained positions, those are in fresh. */
+static uint32_t
+grow_rows(struct flood *flood, int rot, bool soft_drop)
+{
+	uint32_t rows = flood->pending[rot], changed = 0;
+	flood->pending[rot] = 0;
+	if (!rows)
+		return 0;
+
+	/* a row grows from fresh positions or from the row above it */
+	uint16_t *reach = flood->reach.rows[rot];
+	uint16_t *fresh = flood->fresh.rows[rot];
+	int j = __builtin_ctz(rows);
+	uint16_t above = (soft_drop && j) ? reach[j - 1] : 0;
+	for (; j < POS_ROWS; ++j) {
+		uint16_t seeds = reach[j] | above;
+		uint16_t row = seeds ? fill_row(seeds, flood->fit->rows[rot][j]) : 0;
+		uint16_t added = row & ~reach[j];
+		if (rows & (1U << j))
+			added |= fresh[j];
+		if (added) {
+			changed |= 1U << j;
+			fresh[j] = added;
+			reach[j] = row;
+		} else if (!(rows >> j)) {
+			break;
+		}
+		above = soft_drop ? row : 0;
+	}
+	return changed;
+}
+
+/* Grow reach to every position reachable by moving and rotating from the
+ * fresh positions. Only the pending rows and the ones they lead to are
+ * searched. Soft drops are only used when allowed. */
+static void
+flood_positions(struct flood *flood, bool soft_drop)
+{
+	uint32_t *pending = flood->pending;
+	for (int rot = 0; pending[0] | pending[1] | pending[2] | pending[3]; rot = (rot + 1) & 3) {
+		uint32_t changed = grow_rows(flood, rot, soft_drop);
+		rotate_positions(flood, rot, 1, changed);
+		rotate_positions(flood, rot, -1, changed);
+	}
+}
+
+/* Rows above the first open row of a rotation which a placement can depend
+ * on, a kick moves two rows and rotation bottoms differ by up to two */
+#define OPEN_MARGIN 4
+
+/* Soft drops fill every open row below the first one reached, the rows where
+ * the tetromino is entirely above the stack and fits anywhere inside the
+ * grid. Once every rotation is reached well above the stack the open rows
+ * are filled in directly, and the soft drop flood only starts from the ones
+ * a kick can leave. Kicks move down by up to two rows, rotating from the
+ * rows above those only reaches open rows already filled. */
+static void
+seed_open_rows(struct flood *flood, enum tetromino_type type, int stack)
+{
+	int first[4], last[4];
+	for (int rot = 0; rot < 4; ++rot) {
+		last[rot] = stack - 1 - PIECE_MASKS[type][rot].bottom + Y_BIAS;
+		first[rot] = 0;
+		while (first[rot] < POS_ROWS && !flood->reach.rows[rot][first[rot]])
+			++first[rot];
+		if (first[rot] > last[rot] - OPEN_MARGIN)
+			return;
+	}
+
+	for (int rot = 0; rot < 4; ++rot) {
+		int left = last[(rot + 3) & 3], right = last[(rot + 1) & 3];
+		int kicked = (left < right ? left : right) - 1;
+		for (int j = first[rot]; j <= last[rot]; ++j) {
+			flood->reach.rows[rot][j] = flood->fit->rows[rot][j];
+			if (j >= kicked) {
+				flood->fresh.rows[rot][j] = flood->fit->rows[rot][j];
+				flood->pending[rot] |= 1U << j;
+			}
+		}
+	}
+}
+
+/* How a T-piece enters a position by rotating from one of from, taking the
+ * first kick which fits like controls_rotate */
+enum entry {
+	ENTRY_ROTATE = 1 << 0, /* the rotation or one of the first kicks */
+	ENTRY_KICK   = 1 << 1, /* the last kick, which can upgrade a mini tspin */
+};
+
+static unsigned int
+rotated_into(const struct positions *from,
+	     const struct positions *fit,
+	     int rot,
+	     int i,
+	     int j)
+{
+	unsigned int entry = 0;
+	for (int rotate_by = -1; rotate_by <= 1; rotate_by += 2) {
+		int source = (rot - rotate_by) & 3;
+		int direction = rotate_by < 0 ? 0 : 1;
+
+		for (int n = -1; n < 4; ++n) {
+			const int *offset = kick_offset(false, direction, source, n);
+			int si = i - offset[0], sj = j - offset[1];
+			if (si < 0 || si >= 16 || sj < 0 || sj >= POS_ROWS
+			    || !(from->rows[source][sj] & (1U << si)))
+				continue;
+
+			/* an earlier kick which fits is taken instead */
+			bool earlier = false;
+			for (int m = -1; m < n && !earlier; ++m) {
+				const int *other = kick_offset(false, direction, source, m);
+				int ti = si + other[0], tj = sj + other[1];
+				earlier = ti >= 0 && ti < 16 && tj >= 0 && tj < POS_ROWS
+					&& (fit->rows[rot][tj] & (1U << ti));
+			}
+			if (!earlier)
+				entry |= (n == 3) ? ENTRY_KICK : ENTRY_ROTATE;
+		}
+	}
+	return entry;
+}
+
+static inline int
+add_placement(struct placement *placements,
+	      int count,
+	      enum tetromino_type type,
+	      int rot,
+	      int i,
+	      int j,
+	      enum action_type spin,
+	      bool soft_drop)
+{
+	placements[count] = (struct placement) {
+		.type = type,
+		.rotation = rot,
+		.x = i - X_BIAS,
+		.y = j - Y_BIAS,
+		.spin = spin,
+		.soft_drop = soft_drop,
+	};
+	return count + 1;
+}
+
+/* Add a T-piece locking at a position once for each spin it can lock with,
+ * soft is whether locking it without a spin needs a soft drop. A plain move
+ * and a rotation without a spin lock the same placement. */
+static int
+add_tspins(const struct game_state *game,
+	   const struct positions *fit,
+	   const struct positions *reach,
+	   const struct positions *high,
+	   struct placement *placements,
+	   int count,
+	   int rot,
+	   int i,
+	   int j,
+	   bool soft)
+{
+	uint16_t bit = 1U << i;
+	bool spawned = rot == 0 && i == spawn_x(T) + X_BIAS && j == SPAWN_Y + Y_BIAS;
+	bool moved = spawned || (reach->rows[rot][j] & ((bit << 1) | (bit >> 1)))
+		|| (j && (reach->rows[rot][j - 1] & bit));
+
+	/* without a spin a hard drop is as good as any rotation */
+	enum action_type spin = tspin_corners(game, rot, i - X_BIAS, j - Y_BIAS);
+	if (spin == NONE && moved && !soft)
+		return add_placement(placements, count, T, rot, i, j, NONE, false);
+
+	unsigned int entry = rotated_into(reach, fit, rot, i, j);
+	unsigned int entry_high = entry ? rotated_into(high, fit, rot, i, j) : 0;
+	if (!entry)
+		spin = NONE;
+	bool high_spin = (entry_high & ENTRY_ROTATE)
+		|| (spin != MINI_TSPIN && (entry_high & ENTRY_KICK));
+
+	if (spin == NONE) {
+		if (entry)
+			soft = (soft || !moved) && !high_spin;
+		else if (!moved)
+			return count;
+		return add_placement(placements, count, T, rot, i, j, NONE, soft);
+	}
+
+	if (moved)
+		count = add_placement(placements, count, T, rot, i, j, NONE, soft);
+	/* only the last kick upgrades a mini */
+	if (spin == MINI_TSPIN && (entry & ENTRY_KICK))
+		count = add_placement(placements, count, T, rot, i, j, TSPIN,
+				      !(entry_high & ENTRY_KICK));
+	if (spin != MINI_TSPIN || (entry & ENTRY_ROTATE))
+		count = add_placement(placements, count, T, rot, i, j, spin, !high_spin);
+	return count;
+}
+
+/* Every distinct lockable placement of a tetromino of the given type from its
+ * spawn position, searched with the same moves and kicks as the controls.
+ * Placements with the same cells are only listed once, T-pieces are listed
+ * once for each spin they can lock with. Returns the number of placements. */
+int
+game_placements(const struct game_state *game,
+		enum tetromino_type type,
+		struct placement placements[MAX_PLACEMENTS])
+{
+	if (type < I || type > Z)
+		return 0;
+
+	int stack = stack_top(game);
+	struct positions fit;
+	positions_fit(game, type, stack, &fit);
+
+	int spawn_i = spawn_x(type) + X_BIAS;
+	int spawn_j = SPAWN_Y + Y_BIAS;
+	if (game->has_lost || !(fit.rows[0][spawn_j] & (1U << spawn_i)))
+		return 0;
+
+	/* what is reachable without soft drops, then soft drops carry on from
+	 * there to everything reachable */
+	struct flood flood;
+	flood.fit = &fit;
+	flood.is_I = type == I;
+	memset(&flood.reach, 0, sizeof(flood.reach));
+	memset(flood.pending, 0, sizeof(flood.pending));
+	flood.reach.rows[0][spawn_j] = 1U << spawn_i;
+	flood.fresh.rows[0][spawn_j] = 1U << spawn_i;
+	flood.pending[0] = 1U << spawn_j;
+	flood_positions(&flood, false);
+
+	const struct positions *reach = &flood.reach;
+	struct positions high = *reach;
+	seed_open_rows(&flood, type, stack);
+	for (int rot = 0; rot < 4; ++rot) {
+		for (int j = 1; j < POS_ROWS; ++j) {
+			if (reach->rows[rot][j - 1] & fit.rows[rot][j] & ~reach->rows[rot][j]) {
+				flood.fresh.rows[rot][j] = 0;
+				flood.pending[rot] |= 1U << j;
+			}
+		}
+	}
+	flood_positions(&flood, true);
+
+	/* lockable positions, and those where a hard drop from a position
+	 * reachable without soft drops lands */
+	struct positions lock, easy;
+	for (int rot = 0; rot < 4; ++rot) {
+		uint16_t dropped = 0;
+		for (int j = 0; j < POS_ROWS; ++j) {
+			uint16_t below = (j + 1 < POS_ROWS) ? fit.rows[rot][j + 1] : 0;
+			dropped = (dropped & fit.rows[rot][j]) | high.rows[rot][j];
+			lock.rows[rot][j] = reach->rows[rot][j] & ~below;
+			easy.rows[rot][j] = lock.rows[rot][j] & dropped;
+		}
+	}
+
+	/* rotations covering the same cells as an earlier one are moved onto
+	 * it, a soft drop is only needed if neither way around it */
+	for (int rot = 1; rot < 4; ++rot) {
+		const struct piece_mask *piece = &PIECE_MASKS[type][rot];
+		int canon = piece->canon_rotation;
+		if (canon == rot)
+			continue;
+		for (int j = 0; j < POS_ROWS; ++j) {
+			int cj = j + piece->canon_y;
+			if (cj < 0 || cj >= POS_ROWS)
+				continue;
+			lock.rows[canon][cj] |= shift_x(lock.rows[rot][j], piece->canon_x);
+			easy.rows[canon][cj] |= shift_x(easy.rows[rot][j], piece->canon_x);
+		}
+	}
+
+	int count = 0;
+	for (int rot = 0; rot < 4; ++rot) {
+		if (PIECE_MASKS[type][rot].canon_rotation != rot)
+			continue;
+		for (int j = 0; j < POS_ROWS; ++j) {
+			for (uint16_t bits = lock.rows[rot][j]; bits; bits &= bits - 1) {
+				int i = __builtin_ctz(bits);
+				bool soft = !(easy.rows[rot][j] & (1U << i));
+				if (type == T)
+					count = add_tspins(game, &fit, reach, &high, placements,
+							   count, rot, i, j, soft);
+				else
+					count = add_placement(placements, count, type,
+							      rot, i, j, NONE, soft);
+			}
+		}
+	}
+	return count;
+}
@@ -0,0 +1,176 @@
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* grid dimensions, the hidden rows sit above the visible playfield */
+#define HIDDEN_ROWS   2
+#define GRID_ROWS     (20 + HIDDEN_ROWS)
+#define GRID_COLS     10
+#define ROW_FULL      ((1U << GRID_COLS) - 1)
+
+/* game configuration, times are in ticks */
+#define TICK_RATE   	    1000 /* ticks per second */
+#define GRAVITY_CELL	    (1UL << 24) /* gravity is in fractions of a cell */
+#define BAGSIZE     	    7
+#define NPREVIEW   	    5
+#define LOCK_DELAY  	    500
+#define AUTO_SHIFT_DELAY    167 /* das, a held direction starts repeating */
+#define AUTO_REPEAT_RATE    33  /* arr, 0 shifts straight to the wall */
+
+/* Action mapping of (enum, text, and points) */
+#define FOR_EACH_ACTION(X) \
+	X(NONE, , 0) \
+	X(SINGLE, SINGLE, 100) \
+	X(DOUBLE, DOUBLE, 300) \
+	X(TRIPLE, TRIPLE, 500) \
+	X(QUAD, QUAD, 800) \
+	X(PERFECT_SINGLE, PERFECT SINGLE, 800) \
+	X(PERFECT_DOUBLE, PERFECT DOUBLE, 1200) \
+	X(PERFECT_TRIPLE, PERFECT TRIPLE, 1800) \
+	X(PERFECT_QUAD, PERFECT QUAD, 2000) \
+	X(MINI_TSPIN, MINI T-SPIN, 100) \
+	X(MINI_TSPIN_SINGLE, MINI T-SPIN SINGLE, 200) \
+	X(MINI_TSPIN_DOUBLE,  MINI T-SPIN DOUBLE, 400) \
+	X(TSPIN, T-SPIN, 400) \
+	X(TSPIN_SINGLE, T-SPIN SINGLE, 800) \
+	X(TSPIN_DOUBLE, T-SPIN DOUBLE, 1200) \
+	X(TSPIN_TRIPLE, T-SPIN TRIPLE, 1600) \
+
+#define GENERATE_ENUM(ENUM, TEXT, POINTS) ENUM,
+#define GENERATE_TEXT(ENUM, TEXT, POINTS) #TEXT,
+#define GENERATE_POINTS(ENUM, TEXT, POINTS) POINTS,
+
+enum action_type    { FOR_EACH_ACTION(GENERATE_ENUM) };
+enum tetromino_type { EMPTY = -1, I, J, L, O, S, T, Z };
+
+/* parts of the game which are drawn separately, see game_state.generation */
+enum change_type { CHANGE_BOARD, CHANGE_PIECE, CHANGE_HOLD, CHANGE_QUEUE, CHANGE_STATS, NCHANGES };
+
+/* things which happened in a game, see game_state.events */
+enum game_event {
+	EVENT_HARDDROP   = 1 << 0,
+	EVENT_ROTATE     = 1 << 1,
+	EVENT_LINE_CLEAR = 1 << 2,
+	EVENT_TSPIN      = 1 << 3,
+	EVENT_HOLD       = 1 << 4,
+};
+
+/* rotation mapping, indexed by [type][rotation][block][x or y] */
+extern const int ROTATIONS[7][4][4][2];
+
+/* The whole state of a single game. Callers own the storage, there is no
+ * hidden global state so any number of games can be simulated at once. */
+struct game_state {
+	bool has_lost;
+
+	int score;
+	int level, lines_cleared; /* new level every 10 line clears */
+	int combo;                /* consecutive clears counter */
+	bool back_to_back;        /* difficult line clear bonuses */
+	enum action_type tspin;   /* tspin bonuses: NONE, MINI_TSPIN or TSPIN */
+
+	/* last announced action, the serial changes with every announcement */
+	enum action_type action;
+	bool action_back_to_back;
+	unsigned int action_serial;
+	uint64_t action_tick;
+
+	uint64_t tick;	       /* ticks since the game started */
+	uint64_t accumulator;  /* accumulated gravity */
+
+	bool piece_lock;       /* autoplacement of piece due to gravity */
+	uint64_t lock_start;   /* start of lock delay for autoplacement */
+	int move_reset;        /* piece_lock can be reset upto 15 times */
+
+	/* auto shift of a held direction, it moves on the press then repeats
+	 * after das ticks once every arr ticks */
+	int das, arr;
+	int shift;             /* held direction: -1, 0 or 1 */
+	bool shift_held[2];    /* left and right are held */
+	uint64_t shift_start;  /* tick the direction was pressed */
+
+	/* occupancy of each row as a mask, bit x is set when column x is filled.
+	 * The colour plane is only kept for rendering. */
+	uint16_t rows[GRID_ROWS];
+	signed char colors[GRID_ROWS][GRID_COLS];
+	signed char surface[GRID_COLS]; /* highest filled row, GRID_ROWS if none */
+	struct tetromino {
+		enum tetromino_type type;
+		int rotation;
+		int x, y;
+		int ghost_y; /* preview of the tetromino at the bottom */
+	} tetromino;         /* currently held tetromino */
+
+	uint64_t seed;   /* the game replays from its seed */
+	uint64_t random; /* random number generator state */
+
+	int bag_index;
+	enum tetromino_type bag[BAGSIZE]; 	  /* preview and queue */
+	enum tetromino_type shuffle_bag[BAGSIZE]; /* 7-bag shuffle system */
+
+	enum tetromino_type hold; /* held piece */
+	bool has_held;            /* hold could only be used once per piece */
+
+	/* bumped every time a part changes, a renderer compares them with the
+	 * generations it last drew to skip unchanged parts */
+	unsigned int generation[NCHANGES];
+
+	/* game_event bits set as they happen, the caller clears them once it
+	 * has reacted, with sounds for example */
+	unsigned int events;
+};
+
+/* Final resting position of a tetromino, spin is NONE, MINI_TSPIN or TSPIN */
+struct placement {
+	enum tetromino_type type;
+	int rotation;
+	int x, y;
+	enum action_type spin;
+	bool soft_drop; /* set by game_placements when a soft drop is needed */
+};
+
+/* upper bound of placements, every position with each of the three spins */
+#define MAX_PLACEMENTS (3 * 4 * GRID_COLS * GRID_ROWS)
+
+/* Coordinates for block n with given rotation for the current tetromino */
+static inline int
+block_x(const struct game_state *game, int rot, int n)
+{
+	return game->tetromino.x + ROTATIONS[game->tetromino.type][rot][n][0];
+}
+
+static inline int
+block_y(const struct game_state *game, int rot, int n)
+{
+	return game->tetromino.y + ROTATIONS[game->tetromino.type][rot][n][1];
+}
+
+/* Tetromino type filling the cell, EMPTY when there is none */
+static inline enum tetromino_type
+grid_cell(const struct game_state *game, int x, int y)
+{
+	return (game->rows[y] >> x) & 1 ? game->colors[y][x] : EMPTY;
+}
+
+void game_set_to_default(struct game_state *game, uint64_t seed);
+void game_update(struct game_state *game);
+void game_advance(struct game_state *game, uint64_t ticks);
+uint64_t game_next_event(const struct game_state *game);
+bool game_place(struct game_state *game, const struct placement *placement);
+int game_placements(const struct game_state *game,
+		    enum tetromino_type type,
+		    struct placement placements[MAX_PLACEMENTS]);
+
+void spawn_tetromino(struct game_state *game, enum tetromino_type type);
+void place_tetromino(struct game_state *game);
+int update_rows(struct game_state *game, int row);
+void update_score(struct game_state *game, int lines);
+
+void controls_move(struct game_state *game, int x_offset, int y_offset);
+void controls_shift(struct game_state *game, int direction, bool held);
+void controls_rotate(struct game_state *game, int rotate_by);
+void controls_harddrop(struct game_state *game);
+void controls_hold(struct game_state *game);
+#endif
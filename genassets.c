@@ -0,0 +1,102 @@
+/* Generates assets.h, the files of assets/ as arrays compiled into the
+ * binary so nothing is read from disk at startup. Run by make, do not ship.
+ *
+ * genassets [-p] file ...
+ *
+ * A file after -p is stored decoded, as 16 bit PCM at PCM_RATE, so short
+ * effects need no vorbis decode at runtime. Others are stored as they are. */
+#include "extern/miniaudio.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#define PCM_CHANNELS 2
+#define PCM_RATE     48000
+
+static void
+print_bytes(const unsigned char *bytes, size_t size)
+{
+	for (size_t n = 0; n < size; ++n)
+		printf("%d,%s", bytes[n], n % 24 == 23 ? "\n" : "");
+	printf("\n");
+}
+
+/* Print the file as an array, returns its size or -1 */
+static long
+print_file(const char *path, int index)
+{
+	FILE *file = fopen(path, "rb");
+	if (!file)
+		return -1;
+
+	printf("static const unsigned char asset_%d[] = {\n", index);
+	unsigned char bytes[4096];
+	size_t n;
+	long size = 0;
+	while ((n = fread(bytes, 1, sizeof(bytes), file)) > 0) {
+		print_bytes(bytes, n);
+		size += n;
+	}
+	printf("};\n");
+	fclose(file);
+	return size;
+}
+
+/* Print the file decoded as an array of samples, returns the frames or -1 */
+static long
+print_pcm(const char *path, int index)
+{
+	ma_decoder_config config = ma_decoder_config_init(ma_format_s16, PCM_CHANNELS, PCM_RATE);
+	ma_uint64 frames;
+	short *pcm;
+	if (ma_decode_file(path, &config, &frames, (void **) &pcm) != MA_SUCCESS)
+		return -1;
+
+	printf("static const short asset_%d[] = {\n", index);
+	for (ma_uint64 n = 0; n < frames * PCM_CHANNELS; ++n)
+		printf("%d,%s", pcm[n], n % 16 == 15 ? "\n" : "");
+	printf("\n};\n");
+	ma_free(pcm, NULL);
+	return frames;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct { const char *name; long size; bool pcm; } assets[64];
+	int count = 0;
+	bool pcm = false;
+
+	printf("/* generated by genassets, do not edit */\n");
+	for (int n = 1; n < argc && count < 64; ++n) {
+		if (strcmp(argv[n], "-p") == 0) {
+			pcm = true;
+			continue;
+		}
+
+		long size = pcm ? print_pcm(argv[n], count) : print_file(argv[n], count);
+		if (size < 0) {
+			fprintf(stderr, "genassets: can not read %s\n", argv[n]);
+			return 1;
+		}
+		const char *name = strrchr(argv[n], '/');
+		assets[count].name = name ? name + 1 : argv[n];
+		assets[count].size = size;
+		assets[count].pcm = pcm;
+		++count;
+		pcm = false;
+	}
+
+	printf("static const struct asset ASSETS[] = {\n");
+	for (int n = 0; n < count; ++n) {
+		if (assets[n].pcm)
+			printf("\t{ \"%s\", asset_%d, sizeof(asset_%d), %d, %d, %ld },\n",
+			       assets[n].name, n, n, PCM_CHANNELS, PCM_RATE, assets[n].size);
+		else
+			printf("\t{ \"%s\", asset_%d, sizeof(asset_%d), 0, 0, 0 },\n",
+			       assets[n].name, n, n);
+	}
+	printf("};\n");
+	return 0;
+}
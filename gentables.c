@@ -0,0 +1,95 @@
+/* Generates masks.h, the occupancy of every tetromino as ready-shifted row
+ * masks for each rotation and legal column along with its bottom profile
+ * and the first rotation covering the same cells. Run by make, do not ship. */
+#include "engine.h"
+#include "rotations.h"
+
+#include <stdio.h>
+
+static const int rotations[7][4][4][2] = ROTATIONS_TABLE;
+
+/* Check if blocks b translated by (dx, dy) cover the same cells as blocks a,
+ * in which case a tetromino at (x, y) is the same as one at (x + dx, y + dy)
+ * using the rotation of b. */
+static bool
+same_cells(const int a[4][2], const int b[4][2], int *dx, int *dy)
+{
+	int min_a[2] = { 3, 3 }, min_b[2] = { 3, 3 };
+	for (int n = 0; n < 4; ++n) {
+		for (int i = 0; i < 2; ++i) {
+			min_a[i] = a[n][i] < min_a[i] ? a[n][i] : min_a[i];
+			min_b[i] = b[n][i] < min_b[i] ? b[n][i] : min_b[i];
+		}
+	}
+	*dx = min_b[0] - min_a[0];
+	*dy = min_b[1] - min_a[1];
+
+	for (int n = 0; n < 4; ++n) {
+		bool found = false;
+		for (int m = 0; m < 4; ++m) {
+			found |= a[m][0] + *dx == b[n][0]
+			      && a[m][1] + *dy == b[n][1];
+		}
+		if (!found)
+			return false;
+	}
+	return true;
+}
+
+int
+main(void)
+{
+	printf("/* generated by gentables, do not edit */\n");
+	printf("static const struct piece_mask PIECE_MASKS[7][4] = {\n");
+	for (int type = 0; type < 7; ++type) {
+		printf("\t{\n");
+		for (int rot = 0; rot < 4; ++rot) {
+			const int (*blocks)[2] = rotations[type][rot];
+			int min_x = 3, max_x = 0, top = 3, bottom = 0;
+			for (int n = 0; n < 4; ++n) {
+				min_x  = blocks[n][0] < min_x  ? blocks[n][0] : min_x;
+				max_x  = blocks[n][0] > max_x  ? blocks[n][0] : max_x;
+				top    = blocks[n][1] < top    ? blocks[n][1] : top;
+				bottom = blocks[n][1] > bottom ? blocks[n][1] : bottom;
+			}
+
+			/* only positions keeping every block inside the grid */
+			int x_min = -min_x;
+			int x_max = GRID_COLS - 1 - max_x;
+			/* lowest block in each column, -1 for columns without */
+			int profile[4] = { -1, -1, -1, -1 };
+			for (int n = 0; n < 4; ++n) {
+				int *p = &profile[blocks[n][0] - min_x];
+				*p = blocks[n][1] > *p ? blocks[n][1] : *p;
+			}
+
+			/* first rotation covering the same cells once moved */
+			int canon = rot, canon_x = 0, canon_y = 0;
+			for (int r = 0; r < rot; ++r) {
+				int dx, dy;
+				if (same_cells(rotations[type][r], blocks, &dx, &dy)) {
+					canon = r;
+					canon_x = dx;
+					canon_y = dy;
+					break;
+				}
+			}
+
+			printf("\t\t{ %d, %d, %d, %d, %d, { %d, %d, %d, %d }, %d, %d, %d, {\n",
+			       x_min, x_max, top, bottom, max_x - min_x + 1,
+			       profile[0], profile[1], profile[2], profile[3],
+			       canon, canon_x, canon_y);
+			for (int x = x_min; x <= x_max; ++x) {
+				unsigned int rows[4] = {0};
+				for (int n = 0; n < 4; ++n)
+					rows[blocks[n][1]] |= 1U << (x + blocks[n][0]);
+				printf("\t\t\t{ 0x%03x, 0x%03x, 0x%03x, 0x%03x },\n",
+				       rows[0], rows[1], rows[2], rows[3]);
+			}
+			printf("\t\t} },\n");
+		}
+		printf("\t},\n");
+	}
+	printf("};\n");
+	return 0;
+}
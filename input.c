@@ -0,0 +1,135 @@
+#include "input.h"
+
+#include <string.h>
+
+enum decoder_state { GROUND, ESCAPE, CSI, SS3 };
+
+/* kitty event types, the sub-parameter of the modifiers */
+#define EVENT_REPEAT  2
+#define EVENT_RELEASE 3
+#define MOD_CTRL      4
+
+/* last unicode code point, parameters past it stop growing and are no key */
+#define PARAM_MAX 0x10ffff
+
+void
+input_init(struct input_decoder *decoder)
+{
+	*decoder = (struct input_decoder) {0};
+	decoder->state = GROUND;
+}
+
+static int
+arrow_key(char final)
+{
+	switch (final) {
+	case 'A': return INPUT_UP;
+	case 'B': return INPUT_DOWN;
+	case 'C': return INPUT_RIGHT;
+	case 'D': return INPUT_LEFT;
+	default:  return -1;
+	}
+}
+
+/* Key of a finished CSI sequence, -1 for sequences which are not keys */
+static int
+csi_dispatch(struct input_decoder *decoder, char final, struct key_event *event)
+{
+	int *params = decoder->params;
+	if (decoder->private) {
+		/* reply to the kitty protocol query */
+		if (decoder->private == '?' && final == 'u')
+			decoder->kitty = true;
+		return -1;
+	}
+
+	int key = arrow_key(final);
+	if (final == 'u') {
+		key = params[0] <= PARAM_MAX ? params[0] : -1;
+		/* with the kitty protocol control keys no longer send signals */
+		int mods = params[1] ? params[1] - 1 : 0;
+		if ((mods & MOD_CTRL) && key >= 'a' && key <= 'z')
+			key &= 0x1f;
+	}
+	if (key < 0)
+		return -1;
+
+	*event = (struct key_event) {
+		.key = key,
+		.release = decoder->sub[1] == EVENT_RELEASE,
+		.repeat = decoder->sub[1] == EVENT_REPEAT,
+	};
+	return 0;
+}
+
+/* Decode raw terminal input into key events, returns the number of events
+ * with at most one for each byte and one for an escape left from the last
+ * input. Unknown sequences are skipped. An escape
+ * at the end of the input waits for the next read, a sequence can be split
+ * between reads and the escape key is not bound so it can come late. */
+int
+input_decode(struct input_decoder *decoder, const char *bytes, int len,
+	     struct key_event *events)
+{
+	int count = 0;
+	for (int n = 0; n < len; ++n) {
+		unsigned char c = bytes[n];
+		switch (decoder->state) {
+		case GROUND:
+			if (c == 0x1b)
+				decoder->state = ESCAPE;
+			else
+				events[count++] = (struct key_event) { .key = c };
+			break;
+
+		case ESCAPE:
+			if (c == '[') {
+				decoder->state = CSI;
+				decoder->private = 0;
+				decoder->nparams = 0;
+				decoder->nsub = 0;
+				memset(decoder->params, 0, sizeof(decoder->params));
+				memset(decoder->sub, 0, sizeof(decoder->sub));
+			} else if (c == 'O') {
+				decoder->state = SS3;
+			} else {
+				/* a lone escape followed by another key */
+				events[count++] = (struct key_event) { .key = 0x1b };
+				decoder->state = GROUND;
+				--n;
+			}
+			break;
+
+		case CSI:
+			if (c >= '0' && c <= '9') {
+				/* only the first sub-parameter is kept */
+				int *value = (decoder->nsub == 0) ? &decoder->params[decoder->nparams]
+					: (decoder->nsub == 1) ? &decoder->sub[decoder->nparams]
+					: NULL;
+				if (value && *value <= PARAM_MAX)
+					*value = *value * 10 + (c - '0');
+			} else if (c == ';') {
+				if (decoder->nparams < INPUT_PARAMS - 1)
+					++decoder->nparams;
+				decoder->nsub = 0;
+			} else if (c == ':') {
+				if (decoder->nsub < 2)
+					++decoder->nsub;
+			} else if (c >= '<' && c <= '?') {
+				decoder->private = c;
+			} else if (c >= 0x40 && c <= 0x7e) {
+				if (csi_dispatch(decoder, c, &events[count]) == 0)
+					++count;
+				decoder->state = GROUND;
+			}
+			break;
+
+		case SS3:
+			if (arrow_key(c) >= 0)
+				events[count++] = (struct key_event) { .key = arrow_key(c) };
+			decoder->state = GROUND;
+			break;
+		}
+	}
+	return count;
+}
@@ -0,0 +1,41 @@
+#ifndef INPUT_H
+#define INPUT_H
+
+#include <stdbool.h>
+
+/* keys without a character, numbered past the last unicode code point */
+enum input_key {
+	INPUT_UP = 0x110000,
+	INPUT_DOWN,
+	INPUT_RIGHT,
+	INPUT_LEFT,
+};
+
+struct key_event {
+	int key;      /* unicode character or an input_key */
+	bool release; /* releases and repeats need the kitty keyboard protocol */
+	bool repeat;
+};
+
+#define INPUT_PARAMS 4
+
+/* Decoder of raw terminal input, a sequence can be split between reads */
+struct input_decoder {
+	int state;
+	char private;             /* marker of a private CSI such as '?' */
+	int params[INPUT_PARAMS]; /* CSI parameters */
+	int sub[INPUT_PARAMS];    /* first sub-parameter of each, after ':' */
+	int nparams;
+	int nsub;                 /* ':' seen in the current parameter */
+	bool kitty; /* the terminal answered the kitty keyboard protocol query */
+};
+
+/* push the kitty keyboard protocol with event types and query for it, the
+ * terminal only answers the query when it knows the protocol */
+#define KITTY_ENABLE  "\x1b[>3u\x1b[?u"
+#define KITTY_DISABLE "\x1b[<u"
+
+void input_init(struct input_decoder *decoder);
+int input_decode(struct input_decoder *decoder, const char *bytes, int len,
+		 struct key_event *events);
+#endif
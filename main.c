@@ -1,9 +1,63 @@
 #include "tetris.h"
 
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int
+usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-a | -l] [-k] [-p frames[:count]] [-s]\n", name);
+	return 1;
+}
+
+/* A count of at least 1 in decimal at the start of text, end is set past it */
+static bool
+parse_count(const char *text, char **end, unsigned int *count)
+{
+	if (*text < '0' || *text > '9')
+		return false;
+	errno = 0;
+	unsigned long value = strtoul(text, end, 10);
+	if (errno || value == 0 || value > UINT_MAX)
+		return false;
+	*count = value;
+	return true;
+}
+
 int
-main(void)
+main(int argc, char *argv[])
 {
-	game_init();
+	int options = 0;
+	struct sound_config sound = {0};
+	for (int n = 1; n < argc; ++n) {
+		if (strcmp(argv[n], "-a") == 0) {
+			options |= OPTION_ANSI;
+		} else if (strcmp(argv[n], "-l") == 0) {
+			options |= OPTION_HALF;
+		} else if (strcmp(argv[n], "-k") == 0) {
+			options |= OPTION_KITTY;
+		} else if (strcmp(argv[n], "-s") == 0) {
+			options |= OPTION_STATS;
+		} else if (strcmp(argv[n], "-p") == 0 && n + 1 < argc) {
+			/* audio period in frames, optionally followed by :count */
+			char *end;
+			if (!parse_count(argv[++n], &end, &sound.period_frames)
+			    || (*end == ':' && !parse_count(end + 1, &end, &sound.periods))
+			    || *end != '\0')
+				return usage(argv[0]);
+		} else {
+			return usage(argv[0]);
+		}
+	}
+
+	if (game_init(options, &sound) < 0) {
+		fprintf(stderr, "%s: can not set up the terminal\n", argv[0]);
+		return 1;
+	}
 	game_mainloop();
 	game_destroy();
 	return 0;
@@ -0,0 +1,42 @@
+#ifndef ROTATIONS_H
+#define ROTATIONS_H
+/* rotation mapping, indexed by [type][rotation][block][x or y]. Kept as an
+ * initializer so gentables builds the piece masks from the same data, the
+ * tetromino_type enum from engine.h must be in scope. */
+#define ROTATIONS_TABLE { \
+	[I] = {{{0, 1}, {1, 1}, {2, 1}, {3, 1}}, \
+	       {{2, 0}, {2, 1}, {2, 2}, {2, 3}}, \
+	       {{3, 2}, {2, 2}, {1, 2}, {0, 2}}, \
+	       {{1, 3}, {1, 2}, {1, 1}, {1, 0}}}, \
+	\
+	[L] = {{{2, 0}, {2, 1}, {1, 1}, {0, 1}}, \
+	       {{2, 2}, {1, 2}, {1, 1}, {1, 0}}, \
+	       {{0, 2}, {0, 1}, {1, 1}, {2, 1}}, \
+	       {{0, 0}, {1, 0}, {1, 1}, {1, 2}}}, \
+	\
+	[O] = {{{0, 0}, {1, 0}, {1, 1}, {0, 1}}, \
+	       {{1, 0}, {1, 1}, {0, 1}, {0, 0}}, \
+	       {{1, 1}, {0, 1}, {0, 0}, {1, 0}}, \
+	       {{0, 1}, {0, 0}, {1, 0}, {1, 1}}}, \
+	\
+	[Z] = {{{0, 0}, {1, 0}, {1, 1}, {2, 1}}, \
+	       {{2, 0}, {2, 1}, {1, 1}, {1, 2}}, \
+	       {{2, 2}, {1, 2}, {1, 1}, {0, 1}}, \
+	       {{0, 2}, {0, 1}, {1, 1}, {1, 0}}}, \
+	\
+	[T] = {{{1, 0}, {0, 1}, {1, 1}, {2, 1}}, \
+	       {{2, 1}, {1, 0}, {1, 1}, {1, 2}}, \
+	       {{1, 2}, {2, 1}, {1, 1}, {0, 1}}, \
+	       {{0, 1}, {1, 2}, {1, 1}, {1, 0}}}, \
+	\
+	[J] = {{{0, 0}, {0, 1}, {1, 1}, {2, 1}}, \
+	       {{2, 0}, {1, 0}, {1, 1}, {1, 2}}, \
+	       {{2, 2}, {2, 1}, {1, 1}, {0, 1}}, \
+	       {{0, 2}, {1, 2}, {1, 1}, {1, 0}}}, \
+	\
+	[S] = {{{2, 0}, {1, 0}, {1, 1}, {0, 1}}, \
+	       {{2, 2}, {2, 1}, {1, 1}, {1, 0}}, \
+	       {{0, 2}, {1, 2}, {1, 1}, {2, 1}}, \
+	       {{0, 0}, {0, 1}, {1, 1}, {1, 2}}} \
+}
+#endif
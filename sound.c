@@ -0,0 +1,503 @@
+#include "sound.h"
+#include "extern/miniaudio.h"
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef __linux__
+#include <pthread.h>
+#endif
+
+#define SFX_VOICES  16 /* effects playing at once, past it the oldest is cut */
+#define SFX_QUEUE   64
+#define SFX_SAMPLES 4096 /* latencies kept, the oldest are overwritten */
+
+/* assets of the effects, the missing ones stay silent */
+static const char *const SFX_FILES[NSFX] = {
+	[SFX_HARDDROP] = "harddrop.ogg",
+};
+
+/* A file of assets/ compiled in by genassets, either as it is or decoded
+ * into 16 bit samples. See genassets.c */
+struct asset {
+	const char *name;
+	const void *data;
+	size_t size;
+	unsigned int channels, sample_rate; /* 0 unless decoded */
+	ma_uint64 frames;
+};
+
+#include "assets.h"
+
+/* An effect decoded once in the format of the engine, every voice playing
+ * it reads the same frames */
+struct sfx {
+	float *pcm;
+	ma_uint64 frames;
+};
+
+struct voice {
+	const struct sfx *sfx; /* NULL when free */
+	ma_uint64 cursor;
+};
+
+/* Data source which mixes the voices, it is read from the audio thread and
+ * owns the voices so they need no locking */
+struct mixer {
+	ma_data_source_base base;
+	ma_uint32 channels, sample_rate;
+	struct voice voices[SFX_VOICES];
+};
+
+/* an effect started by the game, with the time for measuring latency */
+struct trigger {
+	enum sound_effect effect;
+	uint64_t time;
+};
+
+static ma_context context;
+static ma_device device;
+static ma_engine engine;
+static ma_sound bgm, sfx_sound;
+static bool bgm_loaded, sfx_loaded; /* either can fail without the other */
+static struct mixer mixer;
+static struct sfx sfx[NSFX];
+
+/* effects started by the game and not yet picked up by the mixer */
+static struct trigger sfx_queue[SFX_QUEUE];
+static atomic_uint sfx_head, sfx_tail;
+
+/* loading, the loader thread owns everything until ready is set */
+static struct sound_config config;
+static struct sound_startup startup;
+static uint64_t init_time;
+static int load_status = -1;
+static atomic_bool ready;
+#ifdef __linux__
+static pthread_t loader;
+static bool loading;
+#endif
+
+/* written by the audio thread only */
+static uint64_t sfx_latency[SFX_SAMPLES];
+static uint64_t sfx_played;
+
+static uint64_t
+clock_ns(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/*** Mixer ***/
+
+static void
+voice_start(struct mixer *mixer, const struct sfx *effect)
+{
+	struct voice *voice = &mixer->voices[0];
+	for (int n = 0; n < SFX_VOICES; ++n) {
+		if (!mixer->voices[n].sfx) {
+			voice = &mixer->voices[n];
+			break;
+		}
+		if (mixer->voices[n].cursor > voice->cursor)
+			voice = &mixer->voices[n];
+	}
+	*voice = (struct voice) { effect, 0 };
+}
+
+static ma_result
+mixer_read(ma_data_source *source, void *out, ma_uint64 frames, ma_uint64 *read)
+{
+	struct mixer *mixer = source;
+	unsigned int head = atomic_load_explicit(&sfx_head, memory_order_relaxed);
+	unsigned int tail = atomic_load_explicit(&sfx_tail, memory_order_acquire);
+	if (head != tail) {
+		/* the first frame of the effect is mixed right below */
+		uint64_t now = clock_ns();
+		for (; head != tail; ++head) {
+			const struct trigger *trigger = &sfx_queue[head % SFX_QUEUE];
+			voice_start(mixer, &sfx[trigger->effect]);
+			sfx_latency[sfx_played++ % SFX_SAMPLES] = now - trigger->time;
+		}
+		atomic_store_explicit(&sfx_head, head, memory_order_release);
+	}
+
+	float *samples = out;
+	memset(samples, 0, sizeof(float) * frames * mixer->channels);
+	for (int n = 0; n < SFX_VOICES; ++n) {
+		struct voice *voice = &mixer->voices[n];
+		if (!voice->sfx)
+			continue;
+
+		ma_uint64 left = voice->sfx->frames - voice->cursor;
+		ma_uint64 count = (left < frames ? left : frames) * mixer->channels;
+		const float *pcm = voice->sfx->pcm + voice->cursor * mixer->channels;
+		for (ma_uint64 i = 0; i < count; ++i)
+			samples[i] += pcm[i];
+
+		voice->cursor += count / mixer->channels;
+		if (voice->cursor == voice->sfx->frames)
+			voice->sfx = NULL;
+	}
+
+	*read = frames;
+	return MA_SUCCESS;
+}
+
+static ma_result
+mixer_seek(ma_data_source *source, ma_uint64 frame)
+{
+	(void) source;
+	(void) frame;
+	return MA_SUCCESS;
+}
+
+static ma_result
+mixer_format(ma_data_source *source, ma_format *format, ma_uint32 *channels,
+	     ma_uint32 *sample_rate, ma_channel *map, size_t map_cap)
+{
+	struct mixer *mixer = source;
+	*format = ma_format_f32;
+	*channels = mixer->channels;
+	*sample_rate = mixer->sample_rate;
+	ma_channel_map_init_standard(ma_standard_channel_map_default, map, map_cap,
+				     mixer->channels);
+	return MA_SUCCESS;
+}
+
+static const ma_data_source_vtable mixer_vtable = {
+	.onRead = mixer_read,
+	.onSeek = mixer_seek,
+	.onGetDataFormat = mixer_format,
+};
+
+/*** Sound ***/
+
+static void
+device_read(ma_device *device, void *out, const void *in, ma_uint32 frames)
+{
+	(void) device;
+	(void) in;
+	ma_engine_read_pcm_frames(&engine, out, frames, NULL);
+}
+
+/* The engine mixes into a device of our own, so the period count can be
+ * chosen along with the size */
+static int
+device_init(void)
+{
+	ma_backend null = ma_backend_null;
+	if (ma_context_init(config.null_device ? &null : NULL,
+			    config.null_device ? 1 : 0, NULL, &context) != MA_SUCCESS)
+		return -1;
+
+	ma_device_config device_config = ma_device_config_init(ma_device_type_playback);
+	device_config.playback.format = ma_format_f32;
+	device_config.periodSizeInFrames = config.period_frames;
+	device_config.periods = config.periods;
+	device_config.dataCallback = device_read;
+	if (ma_device_init(&context, &device_config, &device) != MA_SUCCESS) {
+		ma_context_uninit(&context);
+		return -1;
+	}
+	return 0;
+}
+
+static const struct asset *
+asset_find(const char *name)
+{
+	for (size_t n = 0; n < sizeof(ASSETS) / sizeof(ASSETS[0]); ++n)
+		if (strcmp(ASSETS[n].name, name) == 0)
+			return &ASSETS[n];
+	return NULL;
+}
+
+/* Read only files over the assets, the resource manager streams the music
+ * through them and decodes it on its own thread */
+struct asset_file {
+	const struct asset *asset;
+	size_t cursor;
+};
+
+static ma_result
+asset_open(ma_vfs *vfs, const char *path, ma_uint32 mode, ma_vfs_file *file)
+{
+	(void) vfs;
+	const struct asset *asset = asset_find(path);
+	if (!asset || (mode & MA_OPEN_MODE_WRITE))
+		return MA_DOES_NOT_EXIST;
+
+	struct asset_file *open = ma_malloc(sizeof(*open), NULL);
+	if (!open)
+		return MA_OUT_OF_MEMORY;
+	*open = (struct asset_file) { asset, 0 };
+	*file = open;
+	return MA_SUCCESS;
+}
+
+static ma_result
+asset_open_w(ma_vfs *vfs, const wchar_t *path, ma_uint32 mode, ma_vfs_file *file)
+{
+	(void) vfs, (void) path, (void) mode, (void) file;
+	return MA_NOT_IMPLEMENTED;
+}
+
+static ma_result
+asset_close(ma_vfs *vfs, ma_vfs_file file)
+{
+	(void) vfs;
+	ma_free(file, NULL);
+	return MA_SUCCESS;
+}
+
+static ma_result
+asset_read(ma_vfs *vfs, ma_vfs_file file, void *out, size_t size, size_t *read)
+{
+	(void) vfs;
+	struct asset_file *open = file;
+	size_t left = open->asset->size - open->cursor;
+	size_t n = size < left ? size : left;
+	memcpy(out, (const char *) open->asset->data + open->cursor, n);
+	open->cursor += n;
+	if (read)
+		*read = n;
+	return (n == 0 && size > 0) ? MA_AT_END : MA_SUCCESS;
+}
+
+static ma_result
+asset_write(ma_vfs *vfs, ma_vfs_file file, const void *in, size_t size, size_t *written)
+{
+	(void) vfs, (void) file, (void) in, (void) size, (void) written;
+	return MA_ACCESS_DENIED;
+}
+
+static ma_result
+asset_seek(ma_vfs *vfs, ma_vfs_file file, ma_int64 offset, ma_seek_origin origin)
+{
+	(void) vfs;
+	struct asset_file *open = file;
+	ma_int64 base = (origin == ma_seek_origin_start) ? 0
+		: (origin == ma_seek_origin_end) ? (ma_int64) open->asset->size
+		: (ma_int64) open->cursor;
+	if (base + offset < 0 || base + offset > (ma_int64) open->asset->size)
+		return MA_BAD_SEEK;
+	open->cursor = base + offset;
+	return MA_SUCCESS;
+}
+
+static ma_result
+asset_tell(ma_vfs *vfs, ma_vfs_file file, ma_int64 *cursor)
+{
+	(void) vfs;
+	*cursor = ((struct asset_file *) file)->cursor;
+	return MA_SUCCESS;
+}
+
+static ma_result
+asset_info(ma_vfs *vfs, ma_vfs_file file, ma_file_info *info)
+{
+	(void) vfs;
+	info->sizeInBytes = ((struct asset_file *) file)->asset->size;
+	return MA_SUCCESS;
+}
+
+static ma_vfs_callbacks asset_vfs = {
+	asset_open, asset_open_w, asset_close, asset_read,
+	asset_write, asset_seek, asset_tell, asset_info,
+};
+
+/* Decode an effect into the format of the engine, samples decoded at build
+ * time only need converting */
+static int
+sfx_load(struct sfx *effect, const struct asset *asset)
+{
+	if (!asset->frames) {
+		ma_decoder_config decoder = ma_decoder_config_init(ma_format_f32, mixer.channels,
+								   mixer.sample_rate);
+		return ma_decode_memory(asset->data, asset->size, &decoder, &effect->frames,
+					(void **) &effect->pcm) == MA_SUCCESS ? 0 : -1;
+	}
+
+	ma_uint64 frames = ma_convert_frames(NULL, 0, ma_format_f32, mixer.channels, mixer.sample_rate,
+					     asset->data, asset->frames, ma_format_s16,
+					     asset->channels, asset->sample_rate);
+	effect->pcm = ma_malloc(sizeof(float) * frames * mixer.channels, NULL);
+	if (!effect->pcm)
+		return -1;
+	effect->frames = ma_convert_frames(effect->pcm, frames, ma_format_f32, mixer.channels,
+					   mixer.sample_rate, asset->data, asset->frames,
+					   ma_format_s16, asset->channels, asset->sample_rate);
+	return 0;
+}
+
+/* Open the device and the assets, on the loader thread when there is one */
+static int
+sound_load(void)
+{
+	uint64_t start = clock_ns();
+	if (device_init() < 0)
+		return -1;
+
+	ma_engine_config engine_config = ma_engine_config_init();
+	engine_config.pDevice = &device;
+	engine_config.pResourceManagerVFS = &asset_vfs;
+	if (ma_engine_init(&engine_config, &engine) != MA_SUCCESS) {
+		ma_device_uninit(&device);
+		ma_context_uninit(&context);
+		return -1;
+	}
+	startup.device = clock_ns() - start;
+
+	/* the music is streamed, the audio thread only copies decoded pages */
+	start = clock_ns();
+	ma_uint32 music_flags = MA_SOUND_FLAG_STREAM | MA_SOUND_FLAG_NO_SPATIALIZATION;
+	bgm_loaded = ma_sound_init_from_file(&engine, "bgm.ogg", music_flags,
+					     NULL, NULL, &bgm) == MA_SUCCESS;
+	if (bgm_loaded) {
+		ma_sound_set_looping(&bgm, MA_TRUE);
+		ma_sound_start(&bgm);
+	}
+	startup.music = clock_ns() - start;
+
+	start = clock_ns();
+	mixer.channels = ma_engine_get_channels(&engine);
+	mixer.sample_rate = ma_engine_get_sample_rate(&engine);
+	for (int n = 0; n < NSFX; ++n) {
+		const struct asset *asset = SFX_FILES[n] ? asset_find(SFX_FILES[n]) : NULL;
+		if (asset && sfx_load(&sfx[n], asset) < 0)
+			sfx[n] = (struct sfx) {0};
+	}
+
+	/* a single sound plays every effect through the mixer */
+	ma_data_source_config source = ma_data_source_config_init();
+	source.vtable = &mixer_vtable;
+	ma_uint32 flags = MA_SOUND_FLAG_NO_PITCH | MA_SOUND_FLAG_NO_SPATIALIZATION;
+	sfx_loaded = ma_data_source_init(&source, &mixer) == MA_SUCCESS
+		&& ma_sound_init_from_data_source(&engine, &mixer, flags, NULL, &sfx_sound) == MA_SUCCESS;
+	if (sfx_loaded)
+		ma_sound_start(&sfx_sound);
+	startup.effects = clock_ns() - start;
+
+	startup.ready = clock_ns() - init_time;
+	atomic_store_explicit(&ready, true, memory_order_release);
+	return 0;
+}
+
+#ifdef __linux__
+static void *
+sound_loader(void *arg)
+{
+	(void) arg;
+	load_status = sound_load();
+	return NULL;
+}
+#endif
+
+/* Starts loading in the background and returns at once, effects played
+ * before they are loaded are skipped */
+int
+sound_init(const struct sound_config *sound)
+{
+	mixer = (struct mixer) {0};
+	startup = (struct sound_startup) {0};
+	sfx_played = 0;
+	atomic_store(&sfx_head, 0);
+	atomic_store(&sfx_tail, 0);
+	config = *sound;
+	init_time = clock_ns();
+	load_status = -1;
+
+#ifdef __linux__
+	if (pthread_create(&loader, NULL, sound_loader, NULL) == 0) {
+		loading = true;
+		return 0;
+	}
+#endif
+	load_status = sound_load();
+	return load_status;
+}
+
+/* Wait for the loader, returns -1 when there is no sound */
+int
+sound_wait(void)
+{
+#ifdef __linux__
+	if (loading) {
+		pthread_join(loader, NULL);
+		loading = false;
+	}
+#endif
+	return load_status;
+}
+
+void
+sound_destroy(void)
+{
+	if (sound_wait() < 0)
+		return;
+
+	/* the audio thread goes first, it reads everything below */
+	atomic_store(&ready, false);
+	ma_device_uninit(&device);
+	if (sfx_loaded)
+		ma_sound_uninit(&sfx_sound);
+	if (bgm_loaded)
+		ma_sound_uninit(&bgm);
+	bgm_loaded = sfx_loaded = false;
+	ma_engine_uninit(&engine);
+	ma_context_uninit(&context);
+	ma_data_source_uninit(&mixer);
+	for (int n = 0; n < NSFX; ++n) {
+		ma_free(sfx[n].pcm, NULL);
+		sfx[n] = (struct sfx) {0};
+	}
+	load_status = -1;
+}
+
+void
+sound_startup(struct sound_startup *times)
+{
+	*times = startup;
+}
+
+void
+sound_play(enum sound_effect effect)
+{
+	if (!atomic_load_explicit(&ready, memory_order_acquire) || !sfx[effect].pcm)
+		return;
+
+	/* dropped when the mixer has fallen behind by a whole queue */
+	unsigned int tail = atomic_load_explicit(&sfx_tail, memory_order_relaxed);
+	unsigned int head = atomic_load_explicit(&sfx_head, memory_order_acquire);
+	if (tail - head == SFX_QUEUE)
+		return;
+	sfx_queue[tail % SFX_QUEUE] = (struct trigger) { effect, clock_ns() };
+	atomic_store_explicit(&sfx_tail, tail + 1, memory_order_release);
+}
+
+static int
+compare_latency(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+	return (x > y) - (x < y);
+}
+
+void
+sound_latency(struct sound_latency *latency)
+{
+	*latency = (struct sound_latency) { .count = sfx_played };
+	size_t count = sfx_played < SFX_SAMPLES ? sfx_played : SFX_SAMPLES;
+	if (!count)
+		return;
+
+	qsort(sfx_latency, count, sizeof(sfx_latency[0]), compare_latency);
+	latency->p50 = sfx_latency[count * 50 / 100];
+	latency->p90 = sfx_latency[count * 90 / 100];
+	latency->p99 = sfx_latency[count * 99 / 100];
+	latency->max = sfx_latency[count - 1];
+}
@@ -0,0 +1,52 @@
+#ifndef SOUND_H
+#define SOUND_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+enum sound_effect {
+	SFX_HARDDROP,
+	SFX_ROTATE,
+	SFX_LINE_CLEAR,
+	SFX_TSPIN,
+	SFX_HOLD,
+	NSFX
+};
+
+/* Device buffering, smaller periods play effects sooner but wake the audio
+ * thread more often. Zero leaves the choice to the backend. */
+struct sound_config {
+	unsigned int period_frames; /* frames mixed by each audio callback */
+	unsigned int periods;       /* periods buffered by the device */
+	bool null_device;           /* mix on a timer without sound hardware */
+};
+
+/* Time from sound_play until the effect is first mixed, in nanoseconds */
+struct sound_latency {
+	uint64_t count;
+	uint64_t p50, p90, p99, max;
+};
+
+/* Time taken by each step of loading, in nanoseconds */
+struct sound_startup {
+	uint64_t device;  /* audio device and engine */
+	uint64_t music;   /* opening the music stream */
+	uint64_t effects; /* decoding the effects */
+	uint64_t ready;   /* from sound_init until effects play */
+};
+
+/* Music and sound effects, the assets are compiled in and decoded on a
+ * loader thread. Effects without an asset are silent. */
+int sound_init(const struct sound_config *config);
+int sound_wait(void);
+void sound_destroy(void);
+void sound_startup(struct sound_startup *startup);
+
+/* percentiles of the effects played, only once sound_destroy has stopped
+ * the audio thread */
+void sound_latency(struct sound_latency *latency);
+
+/* Start an effect, it plays alongside those already playing. Never blocks or
+ * allocates, but only one thread may call it. */
+void sound_play(enum sound_effect effect);
+#endif
@@ -0,0 +1,40 @@
+#include "sound.h"
+
+/* Sound interface for hosts without audio, built by make server. Nothing
+ * plays and neither miniaudio nor stb_vorbis is linked. */
+
+int
+sound_init(const struct sound_config *config)
+{
+	(void) config;
+	return -1;
+}
+
+int
+sound_wait(void)
+{
+	return -1;
+}
+
+void
+sound_destroy(void)
+{
+}
+
+void
+sound_latency(struct sound_latency *latency)
+{
+	*latency = (struct sound_latency) {0};
+}
+
+void
+sound_startup(struct sound_startup *startup)
+{
+	*startup = (struct sound_startup) {0};
+}
+
+void
+sound_play(enum sound_effect effect)
+{
+	(void) effect;
+}
@@ -1,19 +1,30 @@
 #include "tetris.h"
-#include "extern/miniaudio.h"
-
-#include <assert.h>
+#include "engine.h"
+#include "ansi.h"
+#include "input.h"
+#include "sound.h"
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
 #ifdef __linux__
 #include <unistd.h>
-#include <libgen.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <termios.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/timerfd.h>
 #include <ncurses.h>
 #elif _WIN32
-#include<libloaderapi.h>
-#include <pathcch.h>
 #include <ncurses/ncurses.h>
 #endif
 
@@ -21,834 +32,1133 @@
 #define BORDER_OFFSET 1
 #define BORDERS       2
 
-/* grid placement and dimensions, other UIs are based on these */
-#define HIDDEN_ROWS   2
-#define GRID_ROWS     (20 + HIDDEN_ROWS)
-#define GRID_COLS     10
-#define GRID_H        (GRID_ROWS - HIDDEN_ROWS + BORDERS)
-#define GRID_W        ((GRID_COLS * CELL_WIDTH) + BORDERS)
-#define GRID_X        ((COLS  - GRID_W) / 2)
-#define GRID_Y        ((LINES - GRID_H) / 2)
-
-/* game configuration */
-#define BAGSIZE     	    7
-#define NPREVIEW   	    5
-#define LOCK_DELAY  	    0.5F
-#define ACTION_TEXT_EXPIRE  2.0F
+#define ACTION_TEXT_EXPIRE  2000 /* ticks */
+#define INPUT_QUEUE         256  /* keys waiting for the simulation */
+#define INPUT_READ          64   /* bytes of input decoded at once */
+#define OUTPUT_BACKLOG      4096 /* queued output bytes before frames are dropped */
 
 #define szstr(str) str, sizeof(str)
 
-/* Action mapping of (enum, text, and points) */
-#define FOR_EACH_ACTION(X) \
-	X(NONE, , 0) \
-	X(SINGLE, SINGLE, 100) \
-	X(DOUBLE, DOUBLE, 300) \
-	X(TRIPLE, TRIPLE, 500) \
-	X(QUAD, QUAD, 800) \
-	X(PERFECT_SINGLE, PERFECT SINGLE, 800) \
-	X(PERFECT_DOUBLE, PERFECT DOUBLE, 1200) \
-	X(PERFECT_TRIPLE, PERFECT TRIPLE, 1800) \
-	X(PERFECT_QUAD, PERFECT QUAD, 2000) \
-	X(MINI_TSPIN, MINI T-SPIN, 100) \
-	X(MINI_TSPIN_SINGLE, MINI T-SPIN SINGLE, 200) \
-	X(MINI_TSPIN_DOUBLE,  MINI T-SPIN DOUBLE, 400) \
-	X(TSPIN, T-SPIN, 400) \
-	X(TSPIN_SINGLE, T-SPIN SINGLE, 800) \
-	X(TSPIN_DOUBLE, T-SPIN DOUBLE, 1200) \
-	X(TSPIN_TRIPLE, T-SPIN TRIPLE, 1600) \
-
-#define GENERATE_ENUM(ENUM, TEXT, POINTS) ENUM,
-#define GENERATE_TEXT(ENUM, TEXT, POINTS) #TEXT,
-#define GENERATE_POINTS(ENUM, TEXT, POINTS) POINTS,
-
-enum action_type    { FOR_EACH_ACTION(GENERATE_ENUM) };
-enum tetromino_type { EMPTY = -1, I, J, L, O, S, T, Z };
 enum window_type    { GRID, PREVIEW, HOLD, STATS, ACTION, NWINDOWS };
 
-static const int ACTION_POINTS[] = { FOR_EACH_ACTION(GENERATE_POINTS) };
 static const char* ACTION_TEXT[] = { FOR_EACH_ACTION(GENERATE_TEXT) };
-
-/* rotation mapping, indexed by [type][rotation][block][x or y] */
-static const int ROTATIONS[7][4][4][2] = {
-	[I] = {{{0, 1}, {1, 1}, {2, 1}, {3, 1}},
-	       {{2, 0}, {2, 1}, {2, 2}, {2, 3}},
-	       {{3, 2}, {2, 2}, {1, 2}, {0, 2}},
-	       {{1, 3}, {1, 2}, {1, 1}, {1, 0}}},
-
-	[L] = {{{2, 0}, {2, 1}, {1, 1}, {0, 1}},
-	       {{2, 2}, {1, 2}, {1, 1}, {1, 0}},
-	       {{0, 2}, {0, 1}, {1, 1}, {2, 1}},
-	       {{0, 0}, {1, 0}, {1, 1}, {1, 2}}},
-
-	[O] = {{{0, 0}, {1, 0}, {1, 1}, {0, 1}},
-	       {{1, 0}, {1, 1}, {0, 1}, {0, 0}},
-	       {{1, 1}, {0, 1}, {0, 0}, {1, 0}},
-	       {{0, 1}, {0, 0}, {1, 0}, {1, 1}}},
-
-	[Z] = {{{0, 0}, {1, 0}, {1, 1}, {2, 1}},
-	       {{2, 0}, {2, 1}, {1, 1}, {1, 2}},
-	       {{2, 2}, {1, 2}, {1, 1}, {0, 1}},
-	       {{0, 2}, {0, 1}, {1, 1}, {1, 0}}},
-
-	[T] = {{{1, 0}, {0, 1}, {1, 1}, {2, 1}},
-	       {{2, 1}, {1, 0}, {1, 1}, {1, 2}},
-	       {{1, 2}, {2, 1}, {1, 1}, {0, 1}},
-	       {{0, 1}, {1, 2}, {1, 1}, {1, 0}}},
-
-	[J] = {{{0, 0}, {0, 1}, {1, 1}, {2, 1}},
-	       {{2, 0}, {1, 0}, {1, 1}, {1, 2}},
-	       {{2, 2}, {2, 1}, {1, 1}, {0, 1}},
-	       {{0, 2}, {1, 2}, {1, 1}, {1, 0}}},
-
-	[S] = {{{2, 0}, {1, 0}, {1, 1}, {0, 1}},
-	       {{2, 2}, {2, 1}, {1, 1}, {1, 0}},
-	       {{0, 2}, {1, 2}, {1, 1}, {2, 1}},
-	       {{0, 0}, {0, 1}, {1, 1}, {1, 2}}}
-};
-
-/* KICKTABLE[is_I piece][direction][rotation][tests][offsets]
- *
- * Tests are in order from:
- * wallkicks (left and right), floorkicks, right well kicks, left well kicks
- *
- * The tests are alternative rotations when the natural one fails and are
- * chosen based on: the current rotation and the desired rotation (from)>>(to)
- *
- * These are organized so the right rotation can be indexed using the
- * the current rotation of the tetromino.
- */
-static const int KICKTABLE[2][2][4][4][2] = {
-	/* tests for "J L S Z T" */
-	{
-		/* counterclockwise */
-		{{{ 1, 0}, { 1, -1}, {0,  2}, { 1,  2}},  // 0>>3
-		 {{ 1, 0}, { 1,  1}, {0, -2}, { 1, -2}},  // 1>>0
-		 {{-1, 0}, {-1, -1}, {0,  2}, {-1,  2}},  // 2>>1
-		 {{-1, 0}, {-1,  1}, {0, -2}, {-1, -2}}}, // 3>>2
-		/* clockwise */
-		{{{-1, 0}, {-1, -1}, {0,  2}, {-1,  2}},  // 0>>1
-		 {{ 1, 0}, { 1,  1}, {0, -2}, { 1, -2}},  // 1>>2
-		 {{ 1, 0}, { 1, -1}, {0,  2}, { 1,  2}},  // 2>>3
-		 {{-1, 0}, {-1,  1}, {0, -2}, {-1, -2}}}, // 3>>0
-	},
-	/* tests for "I" */
-	{
-		/* counterclockwise */
-		{{{-1, 0}, { 2, 0}, {-1, -2}, { 2,  1}},  // 0>>3
-		 {{ 2, 0}, {-1, 0}, { 2, -1}, {-1,  2}},  // 1>>0
-		 {{ 1, 0}, {-2, 0}, { 1,  2}, {-2, -1}},  // 2>>1
-		 {{-2, 0}, { 1, 0}, {-2,  1}, { 1, -2}}}, // 3>>2
-		/* clockwise */
-		{{{-2, 0}, { 1, 0}, {-2,  1}, { 1, -2}},  // 0>>1
-		 {{-1, 0}, { 2, 0}, {-1, -2}, { 2,  1}},  // 1>>2
-		 {{ 2, 0}, {-1, 0}, { 2, -1}, {-1,  2}},  // 2>>3
-		 {{ 1, 0}, {-2, 0}, { 1,  2}, {-2, -1}}}, // 3>>0
-	}
+static const short BLOCK_COLORS[] = {
+	COLOR_CYAN, COLOR_BLUE, COLOR_WHITE, COLOR_YELLOW, COLOR_GREEN, COLOR_MAGENTA, COLOR_RED
 };
 
-/* Time for piece to drop based on level. Gravity is constant past level 20 */
-static const float gravity_table[20] = {
-	1.00000F, 0.79300F, 0.61780F, 0.47273F, 0.35520F, 0.26200F, 0.18968F,
-	0.13473F, 0.09388F, 0.06415F, 0.04298F, 0.02822F, 0.01815F, 0.01144F,
-	0.00706F, 0.00426F, 0.00252F, 0.00146F, 0.00082F, 0.00046F,
-};
+/* placement of a window on the terminal */
+struct layout { int y, x, h, w; };
 
-struct game_state {
-	bool running, has_lost;
-
-	int score;
-	int level, lines_cleared; /* new level every 10 line clears */
-	int combo;                /* consecutive clears counter */
-	bool back_to_back;        /* difficult line clear bonuses */
-	enum action_type tspin;   /* tspin bonuses: NONE, MINI_TSPIN or TSPIN */
-
-	float accumulator;	      /* accumulated delta times */
-	struct timespec time_prev;    /* previous frame for delta time*/
-	struct timespec action_start; /* use to expire the action text */
-
-	bool piece_lock;            /* autoplacement of piece due to gravity */
-	struct timespec lock_delay; /* start of lock delay for autoplacement */
-	int move_reset; 	    /* piece_lock can be reset upto 15 times */
-
-	enum tetromino_type grid[GRID_ROWS][GRID_COLS];
-	struct tetromino {
-		enum tetromino_type type;
-		int rotation;
-		int x, y;
-		int ghost_y; /* preview of the tetromino at the bottom */
-	} tetromino;         /* currently held tetromino */
-
-	int bag_index;
-	enum tetromino_type bag[BAGSIZE]; 	  /* preview and queue */
-	enum tetromino_type shuffle_bag[BAGSIZE]; /* 7-bag shuffle system */
-
-	enum tetromino_type hold; /* held piece */
-	bool has_held;            /* hold could only be used once per piece */
+static WINDOW* windows[NWINDOWS]; /* ncurses windows */
+static struct layout layout[NWINDOWS];
+static int term_rows, term_cols;
+
+static bool ansi;          /* draw with the ansi frame instead of ncurses */
+static bool half;          /* ansi with two rows of blocks per line */
+static struct frame frame;
+static atomic_bool running;
+
+/* The simulation runs on its own thread at TICK_RATE and owns the game.
+ * The renderer only reads snapshots of it. */
+struct snapshot {
+	struct game_state game;
+	int high_score;
+	unsigned int games; /* games started, a new one is redrawn in full */
+	uint64_t input_ns;  /* read time of the last key applied */
 };
 
-static WINDOW* windows[NWINDOWS]; /* ncurses windows */
 static struct game_state game = {0};
+static uint64_t epoch;             /* clock ticks when the game started */
 static int high_score = 0;
+static unsigned int games;
+static uint64_t input_ns;
+
+/* Triple buffer of snapshots, the simulation writes the back slot and the
+ * renderer reads the front slot. Finished snapshots are swapped with the
+ * middle slot, which is marked fresh until the renderer takes it. */
+#define SNAPSHOT_FRESH 4
+static struct snapshot snapshots[3];
+static atomic_uint snapshot_middle = 1;
+static unsigned int snapshot_back  = 0;
+static unsigned int snapshot_front = 2;
+static const struct snapshot *snapshot = &snapshots[2];
+static const struct game_state *view = &snapshots[2].game;
+
+/* Keys read by the renderer for the simulation, single producer and
+ * consumer. Each key is applied at the clock tick it was read. */
+struct input_event {
+	struct key_event key;
+	uint64_t time;    /* clock ticks */
+	uint64_t read_ns; /* when it was read, for measuring latency */
+	bool held;        /* the terminal reports releases, keys can be held */
+};
 
-static ma_engine engine;
-static ma_sound bgm, sfx_harddrop;
-
-/* TODO: thoroughly check this function */
-static int
-get_binarydir(char* out, size_t len)
+static struct input_event input_queue[INPUT_QUEUE];
+static atomic_uint input_head, input_tail;
+
+/* eventfds waking up the simulation and the renderer */
+static int sim_wake = -1, render_wake = -1;
+
+/* time from reading a key until it is applied, and until it is on screen */
+struct latency { uint64_t count, total, max; }; /* nanoseconds */
+static struct latency action_latency, frame_latency;
+static uint64_t drawn_input_ns;
+
+static unsigned int action_serial; /* last announced action */
+static bool action_shown;          /* action text waiting to expire */
+static unsigned int drawn[NCHANGES]; /* generations currently on screen */
+static bool redraw = true;         /* draw every part on the next frame */
+static bool drawn_lost;
+static int drawn_high_score;
+static size_t drawn_bytes;
+static unsigned long drawn_dropped;
+static unsigned int drawn_games;
+
+static bool flush_pending;          /* a dropped frame is waiting to be sent */
+static unsigned long frames_dropped;
+
+/* startup, from game_init until the first frame is on the terminal */
+static uint64_t init_ns, first_frame_ns;
+static bool print_stats; /* -s, printed on exit */
+
+/* Monotonic wall clock in simulation ticks */
+static uint64_t
+clock_ticks(void)
 {
-#ifdef __linux__
-	int bytes = readlink("/proc/self/exe", out, len);
-	if (!bytes || bytes >= len)
-		return -1;
-	out[bytes] = '\0';
-	dirname(out);
-#elif _WIN32
-	/* TODO: test on Windows, also remove null terminator */
-	int bytes = GetModuleFileName(NULL, out, len);
-	if (!bytes || bytes >= len)
-		return -1;
-	if (!PathCchRemoveFileSpec(out, len))
-		return -1;
-#endif
-	return strlen(out);
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * TICK_RATE
+		+ now.tv_nsec / (1000000000 / TICK_RATE);
 }
 
-/* Coordinates for block n with given rotation for the current tetromino */
-static inline int
-block_x(int rot, int n)
+static uint64_t
+clock_ns(void)
 {
-	return game.tetromino.x + ROTATIONS[game.tetromino.type][rot][n][0];
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
 }
 
-static inline int
-block_y(int rot, int n)
+static void
+latency_add(struct latency *latency, uint64_t ns)
 {
-	return game.tetromino.y + ROTATIONS[game.tetromino.type][rot][n][1];
+	latency->count += 1;
+	latency->total += ns;
+	if (ns > latency->max)
+		latency->max = ns;
 }
 
-/* Actions which can maintain a back-to-back */
-static bool
-is_difficult(enum action_type type)
-{
-	switch (type) {
-	case QUAD:
-	case MINI_TSPIN_SINGLE:
-	case MINI_TSPIN_DOUBLE:
-	case TSPIN_SINGLE:
-	case TSPIN_DOUBLE:
-	case TSPIN_TRIPLE:
-	case PERFECT_QUAD:		
-		return true;
-	default:
-		return false;
-	}
-	return false;
+static void
+latency_print(const char *name, const struct latency *latency)
+{
+	if (latency->count)
+		fprintf(stderr, "%s: %.1f us average, %.1f us max over %llu keys\n", name,
+			latency->total / 1e3 / latency->count, latency->max / 1e3,
+			(unsigned long long) latency->count);
 }
 
-static inline float
-diff_timespec(const struct timespec *t1, const struct timespec *t0)
+/* seed for a new game, different for every restart */
+static uint64_t
+new_seed(void)
 {
-	return (t1->tv_sec - t0->tv_sec) + (t1->tv_nsec - t0->tv_nsec) * 1e-9;
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	return ((uint64_t) now.tv_sec << 32) ^ (uint64_t) now.tv_nsec;
 }
 
 static void
-shuffle_bag(enum tetromino_type bag[BAGSIZE])
+new_game(void)
 {
-	int j, tmp;
-	for (int i = BAGSIZE - 1; i > 0; --i) {
-		j = rand() % (i + 1);
-		tmp = bag[j];
-		bag[j] = bag[i];
-		bag[i] = tmp;
-	}
+	game_set_to_default(&game, new_seed());
+	epoch = clock_ticks();
+	++games;
 }
 
-/*** Rendering ***/
+/*** Terminal ***/
 
-/* chtype for rendering block of given tetromino type */
-static inline chtype
-block_chtype(enum tetromino_type type)
-{
-	return ' ' | COLOR_PAIR(type + 1);
-}
+#ifdef __linux__
+static int saved_stdout_flags;
+#endif
 
-/* renders a tetromino of type with offset y, this renders *any* tetromino */
-static void
-render_tetromino(WINDOW *w, enum tetromino_type type, int y_offset)
+#ifdef __linux__
+/* ncurses writes to a pipe instead of the terminal, what it wrote is passed
+ * on without blocking so frames are dropped on a slow terminal like those of
+ * the ansi frame. ncurses itself would spin or block on a full terminal. */
+static int curses_pipe[2] = { -1, -1 };
+static char curses_out[4096];
+static size_t curses_out_len, curses_out_sent;
+
+/* Move the output of ncurses on to the terminal, false while some is left */
+static bool
+curses_drain(void)
 {
-	for (int n = 0; n < 4; ++n) {
-		const int *offset = ROTATIONS[type][0][n];
-		int x = BORDER_OFFSET + (offset[0] * CELL_WIDTH);
-		int y = BORDER_OFFSET + offset[1] + y_offset;
-		int c = block_chtype(type);
+	for (;;) {
+		if (curses_out_sent == curses_out_len) {
+			ssize_t n = read(curses_pipe[0], curses_out, sizeof(curses_out));
+			if (n <= 0)
+				return true;
+			curses_out_len = n;
+			curses_out_sent = 0;
+		}
 
-		mvwaddch(w, y, x, c);
-		waddch(w, c);
+		ssize_t n = write(STDOUT_FILENO, curses_out + curses_out_sent,
+				  curses_out_len - curses_out_sent);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return false;
+		curses_out_sent = n > 0 ? curses_out_sent + n : curses_out_len;
 	}
 }
 
-/* renders the active tetromino as either a ghost or regular piece. */
 static void
-render_active_tetromino(bool ghost)
+curses_screen(void)
 {
-	for (int n = 0; n < 4; ++n) {
-		int x = block_x(game.tetromino.rotation, n) * CELL_WIDTH;
-		int y = block_y(game.tetromino.rotation, n);
-		/* use game.ghost_y instead for ghost pieces */
-		y += (ghost * (game.tetromino.ghost_y - game.tetromino.y));
-		chtype c = ghost ? '/' : block_chtype(game.tetromino.type);
-
-		if (y >= HIDDEN_ROWS) {
-			int row = BORDER_OFFSET + y - HIDDEN_ROWS;
-			int col = BORDER_OFFSET + x;
-			mvwaddch(windows[GRID], row, col, c);
-			waddch(windows[GRID], c);
-		}
+	struct winsize size;
+	FILE *out;
+	if (pipe(curses_pipe) < 0 || !(out = fdopen(curses_pipe[1], "w"))) {
+		initscr();
+		return;
 	}
+	fcntl(curses_pipe[0], F_SETFL, O_NONBLOCK);
+	newterm(NULL, out, stdin);
+
+	/* the size can not be read from the pipe */
+	if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0 && size.ws_row && size.ws_col)
+		resizeterm(size.ws_row, size.ws_col);
+	/* the alternate screen is entered before the kitty protocol is pushed */
+	refresh();
+	curses_drain();
+	saved_stdout_flags = fcntl(STDOUT_FILENO, F_GETFL);
+	fcntl(STDOUT_FILENO, F_SETFL, saved_stdout_flags | O_NONBLOCK);
 }
 
+/* Blocking again, the rest of the output goes out before the game exits */
 static void
-render_grid(void)
+curses_screen_destroy(void)
 {
-	for (int y = HIDDEN_ROWS; y < GRID_ROWS; ++y) {
-		int row = BORDER_OFFSET + y - HIDDEN_ROWS;
-		wmove(windows[GRID], row, BORDER_OFFSET);
-		for (int x = 0; x < GRID_COLS; ++x) {
-			chtype c = block_chtype(game.grid[y][x]);
-			waddch(windows[GRID], c);
-			waddch(windows[GRID], c);
-		}
-	}
-	/* Actual tetromino should cover the ghost preview */
-	render_active_tetromino(true);
-	render_active_tetromino(false);
-
-	box(windows[GRID], 0, 0);
-	wrefresh(windows[GRID]);
+	if (curses_pipe[0] < 0)
+		return;
+	fcntl(STDOUT_FILENO, F_SETFL, saved_stdout_flags);
+	curses_drain();
+	close(curses_pipe[0]);
 }
+#endif
 
 static void
-render_preview(void)
+curses_init(void)
 {
-	werase(windows[PREVIEW]);
-	for (int p = 0; p < NPREVIEW; ++p) {
-		int index = (game.bag_index + p) % BAGSIZE;
-		enum tetromino_type type = game.bag[index];
-		render_tetromino(windows[PREVIEW], type, p * 3);
-	}
-	box(windows[PREVIEW], 0, 0);
-	wrefresh(windows[PREVIEW]);
-}
+#ifdef __linux__
+	curses_screen();
+#else
+	initscr();
+#endif
+	cbreak();
+	noecho();
+	curs_set(0);
+	keypad(stdscr, TRUE);
+	nodelay(stdscr, TRUE);
 
-static void
-render_hold(void)
-{
-	werase(windows[HOLD]);
-	render_tetromino(windows[HOLD], game.hold, 0);
-	box(windows[HOLD], 0, 0);
-	wrefresh(windows[HOLD]);
+	if (has_colors()) {
+		start_color();
+		use_default_colors();
+
+		/* add 1 because color pairs start at 0 */
+		for (int type = I; type <= Z; ++type)
+			init_pair(type + 1, COLOR_BLACK, BLOCK_COLORS[type]);
+	} /* no colors then */
+
+	term_rows = LINES;
+	term_cols = COLS;
 }
 
-static void
-render_stats(void)
+#ifdef __linux__
+static struct termios saved_termios;
+static struct input_decoder decoder;
+static bool kitty; /* kitty keyboard protocol requested */
+
+/* Input is read straight from stdin instead of through ncurses and reads
+ * never block. Ctrl-C arrives as a key instead of a signal, see game_input. */
+static int
+raw_input_init(void)
 {
-	werase(windows[STATS]);
-	wprintw(windows[STATS],
-	 	"Lines: %d\n" "Level: %d\n" "Score: %d\n" "High Score: %d\n" "Combo: %d\n",
-		game.lines_cleared, game.level, game.score, high_score, game.combo);
-	wrefresh(windows[STATS]);
+	if (tcgetattr(STDIN_FILENO, &saved_termios) < 0)
+		return -1;
+
+	struct termios raw = saved_termios;
+	raw.c_lflag &= ~(ICANON | ECHO | ISIG);
+	raw.c_cc[VMIN]  = 0;
+	raw.c_cc[VTIME] = 0;
+	tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw);
+
+	input_init(&decoder);
+	if (kitty)
+		write(STDOUT_FILENO, szstr(KITTY_ENABLE) - 1);
+	return 0;
 }
 
 static void
-render_announce(enum action_type type, bool back_to_back)
+raw_input_destroy(void)
 {
-	clock_gettime(CLOCK_MONOTONIC, &game.action_start);
-
-	werase(windows[ACTION]);
-	int pad = (GRID_W - strlen(ACTION_TEXT[type])) / 2;
-	wprintw(windows[ACTION], "%*s%s", pad, "", ACTION_TEXT[type]);
-	wmove(windows[ACTION], 1, 5);
-	wprintw(windows[ACTION], "%s", (back_to_back) ? "BACK TO BACK" : "");
-	wrefresh(windows[ACTION]);
+	if (kitty)
+		write(STDOUT_FILENO, szstr(KITTY_DISABLE) - 1);
+	tcsetattr(STDIN_FILENO, TCSAFLUSH, &saved_termios);
 }
 
+/* Termination signals end the game loop like a quit key, so the terminal is
+ * restored on the way out */
 static void
-render_gameover(void)
+quit_signal(int signal)
 {
-	werase(windows[GRID]);
-	mvwprintw(windows[GRID], 5, 5, "You lost!\n   Press R to restart");
-	box(windows[GRID], 0, 0);
-	wrefresh(windows[GRID]);
+	(void) signal;
+	uint64_t one = 1;
+	running = false;
+	write(render_wake, &one, sizeof(one));
 }
 
-/*** Grid ***/
+/* alternate screen, hidden cursor and a blank screen for the frame, and
+ * back to the shell */
+static const char ANSI_SETUP[] = "\x1b[?1049h\x1b[?25l\x1b[39;49m\x1b[H\x1b[2J";
+static const char ANSI_RESTORE[] = "\x1b[39;49m\x1b[?25h\x1b[?1049l";
 
-static inline bool
-block_valid(int x, int y)
+static void
+ansi_destroy(void)
 {
-	return x >= 0 && x < GRID_COLS
-	    && y >= 0 && y < GRID_ROWS
-	    && game.grid[y][x] == EMPTY;
+	fcntl(STDOUT_FILENO, F_SETFL, saved_stdout_flags);
+	frame_drain(&frame, STDOUT_FILENO);
+	raw_input_destroy();
+	write(STDOUT_FILENO, ANSI_RESTORE, sizeof(ANSI_RESTORE) - 1);
+
+	if (print_stats && frame.frames)
+		fprintf(stderr, "%llu frames, %llu bytes, %.1f bytes per frame, %lu dropped\n",
+			(unsigned long long) frame.frames,
+			(unsigned long long) frame.bytes_total,
+			(double) frame.bytes_total / frame.frames, frames_dropped);
+	frame_free(&frame);
 }
 
-static bool
-row_filled(int row)
+/* Raw terminal for the ansi frame, everything is undone when it fails */
+static int
+ansi_init(void)
 {
-	for (int n = 0; n < GRID_COLS; ++n) {
-		if (game.grid[row][n] == EMPTY)
-			return false;
+	/* read before any step which can fail, ansi_destroy puts them back */
+	saved_stdout_flags = fcntl(STDOUT_FILENO, F_GETFL);
+	if (saved_stdout_flags < 0)
+		return -1;
+
+	struct winsize size;
+	term_rows = 24;
+	term_cols = 80;
+	if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0 && size.ws_row && size.ws_col) {
+		term_rows = size.ws_row;
+		term_cols = size.ws_col;
 	}
-	return true;
+
+	write(STDOUT_FILENO, ANSI_SETUP, sizeof(ANSI_SETUP) - 1);
+	if (raw_input_init() < 0) {
+		write(STDOUT_FILENO, ANSI_RESTORE, sizeof(ANSI_RESTORE) - 1);
+		return -1;
+	}
+
+	/* a slow terminal makes writes fail instead of blocking the game */
+	fcntl(STDOUT_FILENO, F_SETFL, saved_stdout_flags | O_NONBLOCK);
+	if (frame_init(&frame, term_rows, term_cols) < 0) {
+		ansi_destroy();
+		return -1;
+	}
+	return 0;
 }
+#endif
 
-static bool
-row_empty(int row)
+/* Decode the pending input into key events, 0 once there is none */
+static int
+read_keys(struct key_event events[INPUT_READ])
 {
-	for (int n = 0; n < GRID_COLS; ++n) {
-		if (game.grid[row][n] != EMPTY)
-			return false;
+#ifdef __linux__
+	/* room for the escape the decoder can hold from the last read */
+	char bytes[INPUT_READ - 1];
+	ssize_t n = read(STDIN_FILENO, bytes, sizeof(bytes));
+	return n > 0 ? input_decode(&decoder, bytes, n, events) : 0;
+#else
+	int key = getch();
+	switch (key) {
+	case ERR: 	return 0;
+	case KEY_UP: 	key = INPUT_UP; 	break;
+	case KEY_DOWN: 	key = INPUT_DOWN; 	break;
+	case KEY_RIGHT: key = INPUT_RIGHT; 	break;
+	case KEY_LEFT: 	key = INPUT_LEFT; 	break;
 	}
-	return true;
+	events[0] = (struct key_event) { .key = key };
+	return 1;
+#endif
 }
 
-static void
-move_row(int from, int to)
+/*** Drawing ***/
+
+/* The windows are either ncurses windows or areas of the ansi frame. Nothing
+ * is written to the terminal until draw_flush, which sends every window
+ * touched this frame at once. Borders are drawn once in game_init and the
+ * render functions only write the inside of the boxes. */
+
+/* chtype for rendering block of given tetromino type */
+static inline chtype
+block_chtype(enum tetromino_type type)
 {
-	for (int n = 0; n < GRID_COLS; ++n) {
-		game.grid[to][n] = game.grid[from][n];
-		game.grid[from][n] = EMPTY;
-	}
+	return ' ' | COLOR_PAIR(type + 1);
 }
 
-static void
-clear_row(int row)
+/* colour of the ghost piece with half blocks, where '/' can not be drawn */
+#define GHOST_COLOR FRAME_COLOR(8)
+
+/* terminal lines and columns for a number of block rows and columns */
+static int
+box_lines(int rows)
 {
-	for (int n = 0; n < GRID_COLS; ++n)
-		game.grid[row][n] = EMPTY;
+	return half ? (rows + 1) / 2 : rows;
 }
 
-/* Check if the current tetromino is valid at the given rotation and offset */
-static bool
-tetromino_valid(int rotation, int x_offset, int y_offset)
+static int
+box_cols(int cols)
 {
-	for (int n = 0; n < 4; ++n) {
-		int x = block_x(rotation, n) + x_offset;
-		int y = block_y(rotation, n) + y_offset;
-		if (!block_valid(x, y))
-			return false;
-	}
-	return true;
+	return half ? cols : cols * CELL_WIDTH;
 }
 
+/* Draw a block inside a boxed window, y and x count blocks from the inside
+ * of the box. A block is CELL_WIDTH cells wide, or half a cell tall with
+ * half blocks. The ghost is drawn with '/' or the ghost colour. */
 static void
-check_tspin(int kick_test)
+draw_cell(enum window_type w, int y, int x, enum tetromino_type type, bool ghost)
 {
-	/* list of corners clockwise, starting index is current rotation */
-	static const int corners[4][2] = { {0, 0}, {2, 0}, {2, 2}, {0, 2} };
-	/* filled corners: front-left, front-right, back-right, back-left */
-	bool filled[4];
-
-	for (int i = 0; i < 4; ++i) {
-		int index = (game.tetromino.rotation + i) & 3;
-		filled[i] = !block_valid(corners[index][0] + game.tetromino.x,
-			   		 corners[index][1] + game.tetromino.y);
+	if (!ansi) {
+		chtype c = ghost ? '/' : block_chtype(type);
+		mvwaddch(windows[w], BORDER_OFFSET + y, BORDER_OFFSET + x * CELL_WIDTH, c);
+		for (int n = 1; n < CELL_WIDTH; ++n)
+			waddch(windows[w], c);
+		return;
 	}
 
-	if (filled[0] && filled[1] && (filled[2] || filled[3])) {
-		game.tspin = TSPIN;
-	} else if (filled[2] && filled[3] && (filled[0] || filled[1])) {
-		game.tspin = (kick_test == 3) ? TSPIN : MINI_TSPIN;
-	} else {
-		game.tspin = NONE;
+	int color = FRAME_DEFAULT;
+	if (ghost)
+		color = GHOST_COLOR;
+	else if (type != EMPTY)
+		color = FRAME_COLOR(BLOCK_COLORS[type]);
+
+	int row = layout[w].y + BORDER_OFFSET;
+	int col = layout[w].x + BORDER_OFFSET;
+	if (half) {
+		frame_put_half(&frame, row * 2 + y, col + x, color);
 		return;
 	}
 
-	render_announce(game.tspin, false);
+	uint32_t glyph = ghost ? '/' : ' ';
+	int fg = (color == FRAME_DEFAULT || ghost) ? FRAME_DEFAULT : FRAME_COLOR(COLOR_BLACK);
+	int bg = ghost ? FRAME_DEFAULT : color;
+	for (int n = 0; n < CELL_WIDTH; ++n)
+		frame_put(&frame, row + y, col + x * CELL_WIDTH + n, glyph, fg, bg);
 }
 
-/*** Game state ***/
-
-/* Updates the ghost piece, recalculate when position of piece changes */
 static void
-update_ghost(void)
+draw_block(enum window_type w, int y, int x, enum tetromino_type type)
 {
-	int y = 0;
-	while (tetromino_valid(game.tetromino.rotation, 0, y + 1))
-		++y;
-	game.tetromino.ghost_y = y + game.tetromino.y;
+	draw_cell(w, y, x, type, false);
 }
 
-static enum tetromino_type
-next_tetromino(void)
+static void
+draw_ghost(enum window_type w, int y, int x)
 {
-	/* replace with a piece from the shuffle bag to allow for previews */
-	enum tetromino_type type = game.bag[game.bag_index];
-	game.bag[game.bag_index] = game.shuffle_bag[game.bag_index];
-
-	game.bag_index = (game.bag_index + 1) % BAGSIZE;
-	/* shuffle the shuffle_bag once it is exhausted */
-	if (game.bag_index == 0)
-		shuffle_bag(game.shuffle_bag);
-
-	return type;
+	draw_cell(w, y, x, EMPTY, true);
 }
 
-/* Spawn a new tetromino piece with the given type onto the grid */
 static void
-spawn_tetromino(enum tetromino_type type)
+draw_text(enum window_type w, int y, int x, const char *format, ...)
 {
-	game.tetromino.type = type;
-	game.tetromino.rotation = 0;
-
-	/* O-piece has a different starting placement */
-	game.tetromino.x = (type == O) ? 4 : 3;
-	game.tetromino.y = 1;
-	update_ghost();
+	char text[64];
+	va_list args;
+	va_start(args, format);
+	vsnprintf(text, sizeof(text), format, args);
+	va_end(args);
+
+	if (ansi)
+		frame_text(&frame, layout[w].y + y, layout[w].x + x, text);
+	else
+		mvwaddstr(windows[w], y, x, text);
+}
 
-	game.accumulator = 0.0F;
-	game.piece_lock = false;
-	game.move_reset = 0;
-	game.tspin = NONE;
+static void
+draw_erase(enum window_type w)
+{
+	if (ansi)
+		frame_fill(&frame, layout[w].y, layout[w].x, layout[w].h, layout[w].w);
+	else
+		werase(windows[w]);
 }
 
-/* updates score and levels after line clears */
+/* blank the inside of a boxed window, leaving its border alone */
 static void
-update_score(int lines)
+draw_erase_box(enum window_type w)
 {
-	/* where there are no tspin, game.tspin is NONE or 0 */
-	enum action_type action = lines + game.tspin;
-	bool back_to_back = is_difficult(action) && game.back_to_back;
-	double score = ACTION_POINTS[action] * ((back_to_back) ? 1.5 : 1);
+	int height = layout[w].h - BORDERS;
+	int width  = layout[w].w - BORDERS;
+	if (ansi) {
+		frame_fill(&frame, layout[w].y + BORDER_OFFSET, layout[w].x + BORDER_OFFSET,
+			   height, width);
+		return;
+	}
+	for (int y = 0; y < height; ++y)
+		mvwhline(windows[w], BORDER_OFFSET + y, BORDER_OFFSET, ' ', width);
+}
 
-	/* combo bonuses */
-	score += 50 * (game.combo < 0 ? 0 : game.combo);
-	/* perfect line clear bonuses are added to regular clear bonuses */
-	if (row_empty(GRID_ROWS - 1))
-		score += (back_to_back) ? 3200 : ACTION_POINTS[PERFECT_SINGLE + lines];
+static void
+draw_box(enum window_type w)
+{
+	if (ansi)
+		frame_box(&frame, layout[w].y, layout[w].x, layout[w].h, layout[w].w);
+	else
+		box(windows[w], 0, 0);
+}
 
-	game.score += (int) (score * game.level);
-	render_announce(action, back_to_back);
+/* queue a window for the next flush */
+static void
+draw_stage(enum window_type w)
+{
+	if (!ansi)
+		wnoutrefresh(windows[w]);
+}
 
-	game.lines_cleared += lines;
-	game.level = (game.lines_cleared / 10) + 1; /* new level every 10 lines */
-	game.combo = (lines == 0) ? -1 : game.combo + 1;
-	/* t-spins and mini-tspins do not break the chain */
-	if (!back_to_back && game.back_to_back)
-		game.back_to_back = (action == TSPIN || action == MINI_TSPIN);
-	else
-		game.back_to_back = is_difficult(action);
+/* Output still queued for the terminal past the backlog, a slow link */
+static bool
+output_backlogged(void)
+{
+#ifdef __linux__
+	int queued;
+	if (ioctl(STDOUT_FILENO, TIOCOUTQ, &queued) == 0 && queued > OUTPUT_BACKLOG)
+		return true;
+	if (ansi && !frame_drain(&frame, STDOUT_FILENO))
+		return true;
+	if (!ansi && !curses_drain())
+		return true;
+#endif
+	return false;
 }
 
-/* Clear filled rows and shifts rows down. Returns lines cleared */
-static int
-update_rows(int row)
-{
-	/* head will move up the array, removing filled rows and moving
-	 * non-filled rows to the tail at the top of the stack */
-	int head = row;
-	int tail = row;
-	int lines = 0;
-
-	while (head > 0) {
-		if (row_filled(head)) {
-			clear_row(head);
-			++lines;
-		} else {
-			move_row(head, tail);
-			--tail;
-		}
-		--head;
+/* Frames are dropped while the terminal is behind, what they drew stays
+ * staged and goes out merged with the next frame that is flushed */
+static void
+draw_flush(void)
+{
+	flush_pending = output_backlogged();
+	if (flush_pending) {
+		++frames_dropped;
+		return;
 	}
 
-	return lines;
+	if (ansi)
+		frame_flush(&frame, STDOUT_FILENO);
+	else
+		doupdate();
+#ifdef __linux__
+	if (!ansi)
+		curses_drain();
+#endif
+	if (!first_frame_ns)
+		first_frame_ns = clock_ns() - init_ns;
 }
 
-/* Place the active tetromino and handle line clears */
+/*** Rendering ***/
+
+/* renders a tetromino of type with offset y, this renders *any* tetromino */
 static void
-place_tetromino(void)
+render_tetromino(enum window_type w, enum tetromino_type type, int y_offset)
 {
-	int clear_begin = -1;
+	if (type == EMPTY)
+		return;
+
 	for (int n = 0; n < 4; ++n) {
-		int x = block_x(game.tetromino.rotation, n);
-		int y = block_y(game.tetromino.rotation, n);
-		game.grid[y][x] = game.tetromino.type;
-		clear_begin = (row_filled(y) && y > clear_begin) ? y : clear_begin;
+		const int *offset = ROTATIONS[type][0][n];
+		draw_block(w, offset[1] + y_offset, offset[0], type);
 	}
+}
 
-	int lines = (clear_begin != -1) ? update_rows(clear_begin) : 0;
-	update_score(lines);
+/* renders the active tetromino as either a ghost or regular piece. */
+static void
+render_active_tetromino(bool ghost)
+{
+	for (int n = 0; n < 4; ++n) {
+		int x = block_x(view, view->tetromino.rotation, n);
+		int y = block_y(view, view->tetromino.rotation, n);
+		/* use ghost_y instead for ghost pieces */
+		y += (ghost * (view->tetromino.ghost_y - view->tetromino.y));
 
-	/* check for overflow only after lines have been cleared */
-	if (!row_empty(1)) {
-		game.has_lost = true;
-		if (game.score > high_score)
-			high_score = game.score;
-		return;
+		if (y >= HIDDEN_ROWS) {
+			if (ghost)
+				draw_ghost(GRID, y - HIDDEN_ROWS, x);
+			else
+				draw_block(GRID, y - HIDDEN_ROWS, x, view->tetromino.type);
+		}
 	}
-
-	game.has_held = false;
-	spawn_tetromino(next_tetromino());
 }
 
-/*** Game controls ***/
-
 static void
-controls_move(int x_offset, int y_offset)
+render_grid(void)
 {
-	assert(y_offset >= 0 && "tetromino can not be moved up");
-	if (tetromino_valid(game.tetromino.rotation, x_offset, y_offset)) {
-		game.tetromino.x += x_offset;
-		game.tetromino.y += y_offset;
-		game.score += y_offset;
-		update_ghost();
+	for (int y = HIDDEN_ROWS; y < GRID_ROWS; ++y)
+		for (int x = 0; x < GRID_COLS; ++x)
+			draw_block(GRID, y - HIDDEN_ROWS, x, grid_cell(view, x, y));
+	/* Actual tetromino should cover the ghost preview */
+	render_active_tetromino(true);
+	render_active_tetromino(false);
+	draw_stage(GRID);
+}
 
-		if (game.piece_lock && ++game.move_reset < 15)
-			game.piece_lock = false;
+static void
+render_preview(void)
+{
+	draw_erase_box(PREVIEW);
+	for (int p = 0; p < NPREVIEW; ++p) {
+		int index = (view->bag_index + p) % BAGSIZE;
+		enum tetromino_type type = view->bag[index];
+		render_tetromino(PREVIEW, type, p * 3);
 	}
+	draw_stage(PREVIEW);
 }
 
 static void
-controls_rotate(int rotate_by)
+render_hold(void)
 {
-	int rotation = (game.tetromino.rotation + rotate_by) & 3;
-	int kick_test = 0;
+	draw_erase_box(HOLD);
+	render_tetromino(HOLD, view->hold, 0);
+	draw_stage(HOLD);
+}
 
-	/* perform natural rotation */
-	if (tetromino_valid(rotation, 0, 0))
-		goto success;
+static void
+render_stats(void)
+{
+	draw_erase(STATS);
+	draw_text(STATS, 0, 0, "Lines: %d", view->lines_cleared);
+	draw_text(STATS, 1, 0, "Level: %d", view->level);
+	draw_text(STATS, 2, 0, "Score: %d", view->score);
+	draw_text(STATS, 3, 0, "High Score: %d", snapshot->high_score);
+	draw_text(STATS, 4, 0, "Combo: %d", view->combo);
+	if (frames_dropped)
+		draw_text(STATS, 5, 0, "Dropped: %lu", frames_dropped);
+	if (ansi)
+		draw_text(STATS, 6, 0, "Bytes/frame: %zu", frame.bytes);
+	draw_stage(STATS);
+}
 
-	/* natural rotation failed, attempt kicktable rotations */
-	int direction = rotate_by < 0 ? 0 : 1;
-	bool is_I = game.tetromino.type == I;
-	for (int n = 0; n < 4; ++n) {
-		const int *offset = KICKTABLE[is_I][direction][game.tetromino.rotation][n];
+static void
+render_announce(enum action_type type, bool back_to_back)
+{
+	draw_erase(ACTION);
+	int pad = (layout[ACTION].w - strlen(ACTION_TEXT[type])) / 2;
+	draw_text(ACTION, 0, pad, "%s", ACTION_TEXT[type]);
+	if (back_to_back)
+		draw_text(ACTION, 1, (layout[ACTION].w - 12) / 2, "BACK TO BACK");
+	draw_stage(ACTION);
+	action_shown = true;
+}
 
-		if (tetromino_valid(rotation, offset[0], offset[1])) {
-			game.tetromino.x += offset[0];
-			game.tetromino.y += offset[1];
-			kick_test = n;
-			goto success;
-		}
+static void
+render_gameover(void)
+{
+	/* short lines so they fit the narrow grid of half blocks too */
+	static const char *text[] = { "You lost!", "Press R to", "restart" };
+	draw_erase_box(GRID);
+	for (int n = 0; n < 3; ++n) {
+		int x = (layout[GRID].w - strlen(text[n])) / 2;
+		draw_text(GRID, 4 + n, x, "%s", text[n]);
 	}
+	draw_stage(GRID);
+}
 
-	return;
-	success: {
-		game.tetromino.rotation = rotation;
-		update_ghost();
+/*** Simulation ***/
 
-		if (game.tetromino.type == T)
-			check_tspin(kick_test);
+static void
+notify(int fd)
+{
+#ifdef __linux__
+	uint64_t one = 1;
+	if (fd >= 0)
+		write(fd, &one, sizeof(one));
+#else
+	(void) fd;
+#endif
+}
 
-		if (game.piece_lock && ++game.move_reset < 15)
-			game.piece_lock = false;
-	}
+static bool
+input_push(struct input_event event)
+{
+	unsigned int tail = atomic_load_explicit(&input_tail, memory_order_relaxed);
+	unsigned int head = atomic_load_explicit(&input_head, memory_order_acquire);
+	if (tail - head == INPUT_QUEUE)
+		return false;
+	input_queue[tail % INPUT_QUEUE] = event;
+	atomic_store_explicit(&input_tail, tail + 1, memory_order_release);
+	return true;
+}
+
+static bool
+input_pop(struct input_event *event)
+{
+	unsigned int head = atomic_load_explicit(&input_head, memory_order_relaxed);
+	unsigned int tail = atomic_load_explicit(&input_tail, memory_order_acquire);
+	if (head == tail)
+		return false;
+	*event = input_queue[head % INPUT_QUEUE];
+	atomic_store_explicit(&input_head, head + 1, memory_order_release);
+	return true;
 }
 
+/* Copy the game into the back slot and make it the fresh middle one */
 static void
-controls_harddrop(void)
+snapshot_publish(void)
 {
-	/* add two points for each cell harddropped */
-	game.score += (game.tetromino.ghost_y - game.tetromino.y) * 2;
-	game.tetromino.y = game.tetromino.ghost_y;
-	place_tetromino();
+	struct snapshot *back = &snapshots[snapshot_back];
+	back->game = game;
+	back->high_score = high_score;
+	back->games = games;
+	back->input_ns = input_ns;
+	snapshot_back = atomic_exchange_explicit(&snapshot_middle,
+						 snapshot_back | SNAPSHOT_FRESH,
+						 memory_order_acq_rel) & 3;
+}
 
-	ma_sound_start(&sfx_harddrop);
-	ma_sound_seek_to_pcm_frame(&sfx_harddrop, 0);
+/* Take the latest snapshot if there is a new one, the old front is given
+ * back as the middle slot */
+static void
+snapshot_take(void)
+{
+	if (!(atomic_load_explicit(&snapshot_middle, memory_order_acquire) & SNAPSHOT_FRESH))
+		return;
+	snapshot_front = atomic_exchange_explicit(&snapshot_middle, snapshot_front,
+						  memory_order_acq_rel) & 3;
+	snapshot = &snapshots[snapshot_front];
+	view = &snapshot->game;
 }
 
+/* Left and right shift automatically while held when the terminal reports
+ * releases, otherwise each press or terminal repeat is a single move */
 static void
-controls_hold(void)
+sim_key(struct key_event key, bool held)
 {
-	if (game.has_held)
+	if (held && (key.key == INPUT_LEFT || key.key == INPUT_RIGHT)) {
+		if (!key.repeat && !game.has_lost)
+			controls_shift(&game, key.key == INPUT_LEFT ? -1 : 1, !key.release);
+		return;
+	}
+	if (key.release)
 		return;
 
-	game.has_held = true;
-	enum tetromino_type current = game.hold;
-	if (current == EMPTY)
-		current = next_tetromino();
-	game.hold = game.tetromino.type;
+	if (game.has_lost) {
+		if (key.key == 'r')
+			new_game();
+		return;
+	}
 
-	spawn_tetromino(current);
+	switch (key.key) {
+	case INPUT_LEFT:  controls_move(&game, -1, 0); 	break;
+	case INPUT_RIGHT: controls_move(&game, 1, 0); 	break;
+	case INPUT_UP: 	  controls_move(&game, 0, 1); 	break;
+	case INPUT_DOWN:  controls_harddrop(&game); 	break;
+	case 'x': 	controls_rotate(&game, 1); 	break;
+	case 'z': 	controls_rotate(&game, -1); 	break;
+	case 'c': 	controls_hold(&game); 		break;
+	case 'r': 	new_game(); 			break;
+	default: break;
+	}
 }
 
+/* events of the game played by each effect */
+static const unsigned int SFX_EVENTS[NSFX] = {
+	[SFX_HARDDROP]   = EVENT_HARDDROP,
+	[SFX_ROTATE]     = EVENT_ROTATE,
+	[SFX_LINE_CLEAR] = EVENT_LINE_CLEAR,
+	[SFX_TSPIN]      = EVENT_TSPIN,
+	[SFX_HOLD]       = EVENT_HOLD,
+};
+
+/* Play the effects of what happened since the last call */
 static void
-game_set_to_default(void)
+sim_sounds(void)
 {
-	game = (struct game_state) {0};
-	game.hold = EMPTY;
-	game.tspin = NONE;
-	game.level = 1;
-	game.combo = -1;
+	for (int n = 0; n < NSFX && game.events; ++n)
+		if (game.events & SFX_EVENTS[n])
+			sound_play(n);
+	game.events = 0;
+}
 
-	for (int y = 0; y < GRID_ROWS; ++y) {
-		for (int x = 0; x < GRID_COLS; ++x)
-			game.grid[y][x] = EMPTY;
+/* Apply the queued keys at the ticks they were read, catch up with the
+ * clock and publish the result */
+static void
+sim_step(void)
+{
+	struct input_event event;
+	while (input_pop(&event)) {
+		if (event.time > epoch + game.tick)
+			game_advance(&game, event.time - epoch - game.tick);
+		sim_key(event.key, event.held);
+		sim_sounds();
+		input_ns = event.read_ns;
+		latency_add(&action_latency, clock_ns() - event.read_ns);
 	}
 
-	enum tetromino_type initial_bag[BAGSIZE] = { I, J, L, O, S, T, Z };
-	memcpy(game.bag, initial_bag, sizeof(initial_bag));
-	memcpy(game.shuffle_bag, initial_bag, sizeof(initial_bag));
-	shuffle_bag(game.bag);
-	shuffle_bag(game.shuffle_bag);
+	/* the simulation follows the wall clock one tick at a time */
+	game_advance(&game, clock_ticks() - epoch - game.tick);
+	sim_sounds();
 
-	/* set previous time frame to prevent instant gravity upon restart */
-	clock_gettime(CLOCK_MONOTONIC, &game.time_prev);
-	spawn_tetromino(next_tetromino());
+	if (game.has_lost && game.score > high_score)
+		high_score = game.score;
 
-	game.running = true;
+	snapshot_publish();
+	notify(render_wake);
 }
 
-/*** Game loop ***/
+/* Ticks until the simulation has work without input, UINT64_MAX for none.
+ * The renderer needs a snapshot when the action text expires. */
+static uint64_t
+sim_deadline(void)
+{
+	uint64_t ticks = game_next_event(&game);
+	uint64_t expire = game.action_tick + ACTION_TEXT_EXPIRE + 1;
+	if (game.action_serial && game.tick < expire && expire - game.tick < ticks)
+		ticks = expire - game.tick;
+	return ticks;
+}
 
+#ifdef __linux__
+/* Arm the timer for the clock tick of the next deadline, disarm for none */
 static void
-game_input(void)
+arm_timer(int timer, uint64_t ticks)
 {
-	int key = getch();
-	if (game.has_lost) {
-		if (key == 'r')
-			game_set_to_default();
-		return;
+	struct itimerspec spec = {0};
+	if (ticks != UINT64_MAX) {
+		uint64_t deadline = epoch + game.tick + ticks;
+		spec.it_value.tv_sec  = deadline / TICK_RATE;
+		spec.it_value.tv_nsec = deadline % TICK_RATE * (1000000000 / TICK_RATE);
 	}
+	timerfd_settime(timer, TFD_TIMER_ABSTIME, &spec, NULL);
+}
 
-	switch (key) {
-	case KEY_LEFT: 	controls_move(-1, 0); 	break;
-	case KEY_RIGHT: controls_move(1, 0); 	break;
-	case KEY_UP: 	controls_move(0, 1); 	break;
-	case KEY_DOWN: 	controls_harddrop(); 	break;
-	case 'x': 	controls_rotate(1); 	break;
-	case 'z': 	controls_rotate(-1); 	break;
-	case 'c': 	controls_hold(); 	break;
-	case 'r': 	game_set_to_default(); 	break;
-	case 'q': 	game.running = false; 	break;
-	default: break;
+/* Sleep until there are keys or the next deadline is due, ticks are only
+ * simulated when something can happen */
+static void *
+sim_thread(void *arg)
+{
+	(void) arg;
+	int timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	struct pollfd fds[] = {
+		{ .fd = sim_wake, .events = POLLIN },
+		{ .fd = timer,    .events = POLLIN },
+	};
+
+	while (running) {
+		sim_step();
+
+		/* without a timer fall back to waking every tick */
+		arm_timer(timer, sim_deadline());
+		poll(fds, timer < 0 ? 1 : 2, timer < 0 ? 1000 / TICK_RATE : -1);
+
+		uint64_t count;
+		if (fds[0].revents & POLLIN)
+			read(sim_wake, &count, sizeof(count));
+		if (timer >= 0 && fds[1].revents & POLLIN)
+			read(timer, &count, sizeof(count));
 	}
+
+	if (timer >= 0)
+		close(timer);
+	return NULL;
 }
+#endif
 
+/*** Game loop ***/
+
+/* Read every pending key and queue them for the simulation in one go. A
+ * burst of keys read together shares a timestamp, so they all land on the
+ * same tick and show up in the same frame. */
 static void
-game_update(void)
+game_input(void)
 {
-	struct timespec time_now;
-	clock_gettime(CLOCK_MONOTONIC, &time_now);
-
-	game.accumulator += diff_timespec(&time_now, &game.time_prev);
-	game.time_prev = time_now;
+	uint64_t now = clock_ticks();
+	bool queued = false;
+	bool held = false;
+#ifdef __linux__
+	held = decoder.kitty;
+#endif
 
-	/* do gravity, otherwise start autoplacement */
-	if (tetromino_valid(game.tetromino.rotation, 0, 1)) {
-		int i = game.level > 20 ? 19 : game.level - 1;
-		if (game.accumulator > gravity_table[i]) {
-			game.accumulator -= gravity_table[i];
-			game.tetromino.y += 1;
-		}
-	} else {
-		if (!game.piece_lock) {
-			game.piece_lock = true;
-			game.lock_delay = time_now;
+	struct key_event keys[INPUT_READ];
+	int count;
+	while (running && (count = read_keys(keys)) > 0) {
+		uint64_t read_ns = clock_ns();
+		for (int n = 0; n < count; ++n) {
+			/* ctrl-c is a key, the terminal sends no signals */
+			if (keys[n].key == 'q' || keys[n].key == 0x03) {
+				running = false;
+				break;
+			}
+			queued |= input_push((struct input_event) { keys[n], now, read_ns, held });
 		}
 	}
 
-	/* piece autoplacement is independent of gravity */
-	if (game.piece_lock && diff_timespec(&time_now, &game.lock_delay) > LOCK_DELAY)
-		place_tetromino();
+	if (queued)
+		notify(sim_wake);
+}
 
-	if (diff_timespec(&time_now, &game.action_start) > ACTION_TEXT_EXPIRE) {
-		werase(windows[ACTION]);
-		wrefresh(windows[ACTION]);
-	}
+/* part changed since it was last drawn, marks it as drawn */
+static bool
+changed(enum change_type part)
+{
+	bool dirty = redraw || view->generation[part] != drawn[part];
+	drawn[part] = view->generation[part];
+	return dirty;
 }
 
+/* Redraw the windows whose parts changed in the latest snapshot and flush
+ * them in one go */
 static void
 game_render(void)
 {
-	if (game.has_lost) {
-		render_gameover();
+	snapshot_take();
+	if (snapshot->games != drawn_games)
+		redraw = true;
+
+	bool board = changed(CHANGE_BOARD);
+	bool piece = changed(CHANGE_PIECE);
+	bool hold  = changed(CHANGE_HOLD);
+	bool queue = changed(CHANGE_QUEUE);
+	bool stats = changed(CHANGE_STATS) || snapshot->high_score != drawn_high_score
+		|| (ansi && frame.bytes != drawn_bytes) || frames_dropped != drawn_dropped;
+	bool lost  = view->has_lost && (redraw || !drawn_lost);
+	bool flush = board || piece || hold || queue || stats || lost;
+
+	if (view->action_serial != action_serial) {
+		action_serial = view->action_serial;
+		render_announce(view->action, view->action_back_to_back);
+		flush = true;
+	} else if (action_shown && view->tick - view->action_tick > ACTION_TEXT_EXPIRE) {
+		draw_erase(ACTION);
+		draw_stage(ACTION);
+		action_shown = false;
+		flush = true;
+	}
+
+	if (view->has_lost) {
+		if (lost)
+			render_gameover();
 	} else {
-		render_grid();
-		render_hold();
+		if (board || piece)
+			render_grid();
+		if (hold)
+			render_hold();
+		if (queue)
+			render_preview();
+	}
+	if (stats)
 		render_stats();
-		render_preview();
+
+	if (flush || flush_pending)
+		draw_flush();
+	if (!flush_pending && snapshot->input_ns != drawn_input_ns) {
+		if (flush)
+			latency_add(&frame_latency, clock_ns() - snapshot->input_ns);
+		drawn_input_ns = snapshot->input_ns;
 	}
+	redraw = false;
+	drawn_lost = view->has_lost;
+	drawn_high_score = snapshot->high_score;
+	drawn_bytes = frame.bytes;
+	drawn_dropped = frames_dropped;
+	drawn_games = snapshot->games;
 }
 
+/* Simulate and render on the one thread, polling for keys */
+static void
+game_loop_inline(void)
+{
+	while (running) {
+		game_input();
+		sim_step();
+		game_render();
+	}
+}
+
+#ifdef __linux__
+/* The renderer sleeps until there are keys, a new snapshot or room for a
+ * dropped frame. A slow terminal only delays drawing, never the game. */
 void
 game_mainloop(void)
 {
-	while (game.running) {
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, sim_thread, NULL) != 0) {
+		game_loop_inline();
+		return;
+	}
+
+	while (running) {
 		game_input();
-		game_update();
 		game_render();
+		if (!running)
+			break;
+
+		/* a dropped frame is retried once the terminal takes output again */
+		struct pollfd fds[] = {
+			{ .fd = STDIN_FILENO,  .events = POLLIN },
+			{ .fd = render_wake,   .events = POLLIN },
+			{ .fd = STDOUT_FILENO, .events = POLLOUT },
+		};
+		poll(fds, flush_pending ? 3 : 2, -1);
+		if (fds[0].revents & (POLLHUP | POLLERR))
+			running = false;
+		if (fds[1].revents & POLLIN) {
+			uint64_t count;
+			read(render_wake, &count, sizeof(count));
+		}
 	}
+
+	notify(sim_wake);
+	pthread_join(thread, NULL);
+}
+#else
+void
+game_mainloop(void)
+{
+	game_loop_inline();
 }
+#endif
 
 int
-game_init(void)
+game_init(int options, const struct sound_config *sound)
 {
-	if (game.running)
+	if (running)
 		return -1;
+	init_ns = clock_ns();
+	print_stats = options & OPTION_STATS;
 
-	/* ncurses initialization */
-	initscr();
-	cbreak();
-	noecho();
-	curs_set(0);
-	keypad(stdscr, TRUE);
-	nodelay(stdscr, TRUE);
-
-	if (has_colors()) {
-		start_color();
-		use_default_colors();
+#ifdef __linux__
+	/* input is read raw from a terminal, fail before the screen is touched */
+	struct termios termios;
+	if (tcgetattr(STDIN_FILENO, &termios) < 0)
+		return -1;
 
-		/* add 1 because color pairs start at 0 */
-		init_pair(I + 1, COLOR_BLACK, COLOR_CYAN);
-		init_pair(J + 1, COLOR_BLACK, COLOR_BLUE);
-		init_pair(L + 1, COLOR_BLACK, COLOR_WHITE);
-		init_pair(O + 1, COLOR_BLACK, COLOR_YELLOW);
-		init_pair(S + 1, COLOR_BLACK, COLOR_GREEN);
-		init_pair(T + 1, COLOR_BLACK, COLOR_MAGENTA);
-		init_pair(Z + 1, COLOR_BLACK, COLOR_RED);
-	} /* no colors then */
+	sim_wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	render_wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (sim_wake < 0 || render_wake < 0)
+		goto close_wakes;
 
-	/* Enough space to fit any tetromino with borders */
-	int box_w   = (4 * CELL_WIDTH) + BORDERS;
-	int box_h   = 3 + BORDERS;
-	/* don't multiply the borders width, add it afterwards */
-	int preview_h = (NPREVIEW * (box_h - BORDERS)) + BORDERS;
-
-	windows[GRID]    = newwin(GRID_H, GRID_W, GRID_Y, GRID_X);
-	windows[HOLD]    = newwin(box_h, box_w, GRID_Y, GRID_X - box_w);
-	windows[STATS]   = newwin(8, 20, LINES / 2, GRID_X - 20);
-	windows[ACTION]  = newwin(2, GRID_W, GRID_Y + GRID_H, GRID_X);
-	windows[PREVIEW] = newwin(preview_h, box_w, GRID_Y, GRID_X + GRID_W);
-
-	/* audio and sound initialization */
-	if (ma_engine_init(NULL, &engine) != MA_SUCCESS)
-		return -1;
+	half = options & OPTION_HALF;
+	ansi = half || (options & OPTION_ANSI);
+	kitty = options & OPTION_KITTY;
+	if (ansi && ansi_init() < 0)
+		goto close_wakes;
+#endif
+	if (!ansi)
+		curses_init();
+#ifdef __linux__
+	if (!ansi && raw_input_init() < 0) {
+		endwin();
+		curses_screen_destroy();
+		goto close_wakes;
+	}
+#endif
 
-	char path[256];
-	int len = get_binarydir(path, sizeof(path));
-	ma_uint32 flags = MA_SOUND_FLAG_NO_PITCH | MA_SOUND_FLAG_DECODE;
+	/* grid placement and dimensions, other UIs are based on these */
+	int grid_h = box_lines(GRID_ROWS - HIDDEN_ROWS) + BORDERS;
+	int grid_w = box_cols(GRID_COLS) + BORDERS;
+	int grid_y = (term_rows - grid_h) / 2;
+	int grid_x = (term_cols - grid_w) / 2;
 
-	memcpy(path + len, szstr("/assets/bgm.ogg"));
-	ma_sound_init_from_file(&engine, path, MA_SOUND_FLAG_STREAM, NULL, NULL, &bgm);
-	memcpy(path + len, szstr("/assets/harddrop.ogg"));
-	ma_sound_init_from_file(&engine, path, flags, NULL, NULL, &sfx_harddrop);
+	/* Enough space to fit any tetromino with borders */
+	int box_w   = box_cols(4) + BORDERS;
+	int box_h   = box_lines(3) + BORDERS;
+	int preview_h = box_lines(NPREVIEW * 3) + BORDERS;
+	/* the action text is wider than the grid of half blocks */
+	int action_w = grid_w > 20 ? grid_w : 20;
+
+	layout[GRID]    = (struct layout) { grid_y, grid_x, grid_h, grid_w };
+	layout[HOLD]    = (struct layout) { grid_y, grid_x - box_w, box_h, box_w };
+	layout[STATS]   = (struct layout) { term_rows / 2, grid_x - 20, 8, 20 };
+	layout[ACTION]  = (struct layout) { grid_y + grid_h, grid_x - (action_w - grid_w) / 2,
+					    2, action_w };
+	layout[PREVIEW] = (struct layout) { grid_y, grid_x + grid_w, preview_h, box_w };
+
+	for (int w = 0; w < NWINDOWS && !ansi; ++w)
+		windows[w] = newwin(layout[w].h, layout[w].w, layout[w].y, layout[w].x);
+
+	/* static chrome, never erased by the render functions */
+	draw_box(GRID);
+	draw_box(HOLD);
+	draw_box(PREVIEW);
+
+	/* sounds load in the background and the game plays silently until
+	 * they are ready, or without them when there is no audio device */
+	sound_init(sound);
 
-	ma_sound_start(&bgm);
-	ma_sound_set_looping(&bgm, true);
+#ifdef __linux__
+	struct sigaction quit = { .sa_handler = quit_signal };
+	sigaction(SIGINT, &quit, NULL);
+	sigaction(SIGTERM, &quit, NULL);
+	sigaction(SIGHUP, &quit, NULL);
+#endif
 
-	srand(time(NULL));
-	game_set_to_default();
+	new_game();
+	snapshot_publish();
+	snapshot_take();
+	running = true;
 	return 1;
+
+#ifdef __linux__
+	close_wakes:
+	if (sim_wake >= 0)
+		close(sim_wake);
+	if (render_wake >= 0)
+		close(render_wake);
+	return -1;
+#endif
 }
 
 void
 game_destroy(void)
 {
-	ma_sound_uninit(&bgm);
-	ma_sound_uninit(&sfx_harddrop);
-	ma_engine_uninit(&engine);
+#ifdef __linux__
+	close(sim_wake);
+	close(render_wake);
+#endif
+	sound_destroy();
 
-	wclear(stdscr);
-	endwin();
+	struct sound_latency sfx;
+	struct sound_startup startup;
+	sound_latency(&sfx);
+	sound_startup(&startup);
+
+#ifdef __linux__
+	if (ansi)
+		ansi_destroy();
+	else
+		raw_input_destroy();
+#endif
+	if (!ansi) {
+		wclear(stdscr);
+		endwin();
+#ifdef __linux__
+		curses_screen_destroy();
+#endif
+		if (print_stats && frames_dropped)
+			fprintf(stderr, "%lu frames dropped\n", frames_dropped);
+	}
+	if (!print_stats)
+		return;
+
+	latency_print("input to action", &action_latency);
+	latency_print("input to frame", &frame_latency);
+	if (sfx.count)
+		fprintf(stderr, "effect to mix: %.1f us p50, %.1f us p90, %.1f us p99, "
+			"%.1f us max over %llu effects\n", sfx.p50 / 1e3, sfx.p90 / 1e3,
+			sfx.p99 / 1e3, sfx.max / 1e3, (unsigned long long) sfx.count);
+	if (startup.ready)
+		fprintf(stderr, "startup: first frame %.1f ms, audio device %.1f ms, music %.1f ms, "
+			"effects %.1f ms, sound ready %.1f ms\n", first_frame_ns / 1e6,
+			startup.device / 1e6, startup.music / 1e6, startup.effects / 1e6,
+			startup.ready / 1e6);
+	else
+		fprintf(stderr, "startup: first frame %.1f ms, no sound\n", first_frame_ns / 1e6);
 }
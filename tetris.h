@@ -1,6 +1,17 @@
 #ifndef TETRIS_H
 #define TETRIS_H
-int game_init(void);
+
+#include "sound.h"
+
+/* options for game_init */
+enum game_option {
+	OPTION_ANSI = 1 << 0, /* draw with raw ansi sequences instead of ncurses */
+	OPTION_HALF = 1 << 1, /* ansi with half blocks, fewer bytes for slow links */
+	OPTION_KITTY = 1 << 2, /* ask for key releases with the kitty keyboard protocol */
+	OPTION_STATS = 1 << 3, /* print frame, latency and startup stats on exit */
+};
+
+int game_init(int options, const struct sound_config *sound);
 void game_destroy(void);
 void game_mainloop(void);
 #endif